@@ -4,21 +4,46 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <string.h>
 #include "bf_runner.h"
 #include "bf_runner_direct.h"
 #include "bf_runner_bf_insn.h"
+#include "bf_runner_threaded.h"
+#include "bf_runner_tiered.h"
 #include "bf_runner_jit.h"
+#include "bf_runner_fast_jit.h"
 #include "bf_compiler.h"
 
 struct BfOption
 {
     bool interpretBfInst;
+    bool interpretThreaded;
+    bool interpretTiered;
     bool interpretDirect;
     bool interpretJit;
+    bool interpretFastJit;
     bool aot;
     bool emitIr;
     bool printElapsed;
     bool noRun;
+    int optLevel;
+    int llvmOptLevel;
+    BfFlushPolicy flushPolicy;
+    size_t outputBufferSize;
+    size_t inputBufferSize;
+    size_t tapeSize;
+    bool tapeHugePages;
+    std::string optPasses;
+    bool jitCache;
+    std::string jitCacheDir;
+    bool jitLazy;
+    unsigned jitThreads;
+    std::string march;
+    std::string mattr;
+    BfAotRuntime aotRuntime;
+    uint32_t tierThreshold;
+    bool pgoInstrument;
+    std::string pgoProfile;
     std::string bfFile;
     std::string outputExecutablePath;
 };
@@ -27,23 +52,82 @@ enum
 {
     OPT_START = 0x100,
     OPT_BF_INSN,
+    OPT_THREADED,
+    OPT_TIERED,
     OPT_DIRECT,
     OPT_JIT,
+    OPT_FAST_JIT,
     OPT_AOT,
     OPT_EMIT_IR,
     OPT_PRINT_ELAPSED,
+    OPT_PASSES,
+    OPT_LLVM_OPT,
+    OPT_FLUSH,
+    OPT_OUTPUT_BUFFER,
+    OPT_INPUT_BUFFER,
+    OPT_TAPE_SIZE,
+    OPT_TAPE_HUGE_PAGES,
+    OPT_JIT_CACHE,
+    OPT_JIT_CACHE_DIR,
+    OPT_JIT_LAZY,
+    OPT_JIT_THREADS,
+    OPT_AOT_RUNTIME,
+    OPT_PGO_INSTRUMENT,
+    OPT_PGO_USE,
+    OPT_TIER_THRESHOLD,
+    OPT_MARCH,
+    OPT_MATTR,
 };
 
+static size_t parseBufferSize(const char *name, const char *arg)
+{
+    char *end;
+    unsigned long size = strtoul(arg, &end, 10);
+    if (arg[0] < '0' || arg[0] > '9' || *end != '\0' || size == 0 || size > (1ul << 30))
+    {
+        fprintf(stderr, "Error: Invalid %s size %s, expected 1 to %lu bytes.\n", name, arg, 1ul << 30);
+        exit(EXIT_FAILURE);
+    }
+    return size;
+}
+
 BfOption parseOptions(int argc, char *argv[])
 {
     BfOption options = {};
+    options.optLevel = 3;
+    options.llvmOptLevel = 2;
+    options.flushPolicy = BF_FLUSH_READ;
+    options.outputBufferSize = BF_IO_BUF_SIZE;
+    options.inputBufferSize = BF_IO_BUF_SIZE;
+    options.tapeSize = BF_TAPE_DEFAULT_SIZE;
+    options.tierThreshold = BF_TIERED_THRESHOLD;
     struct option longOptions[] = {
         {"bf-insn", no_argument, nullptr, OPT_BF_INSN},
+        {"threaded", no_argument, nullptr, OPT_THREADED},
+        {"tiered", no_argument, nullptr, OPT_TIERED},
+        {"tier-threshold", required_argument, nullptr, OPT_TIER_THRESHOLD},
         {"direct", no_argument, nullptr, OPT_DIRECT},
         {"jit", no_argument, nullptr, OPT_JIT},
+        {"fast-jit", no_argument, nullptr, OPT_FAST_JIT},
         {"aot", no_argument, nullptr, OPT_AOT},
         {"emit-ir", no_argument, nullptr, OPT_EMIT_IR},
         {"print-elapsed", no_argument, nullptr, OPT_PRINT_ELAPSED},
+        {"passes", required_argument, nullptr, OPT_PASSES},
+        {"llvm-opt", required_argument, nullptr, OPT_LLVM_OPT},
+        {"flush", required_argument, nullptr, OPT_FLUSH},
+        {"output-buffer", required_argument, nullptr, OPT_OUTPUT_BUFFER},
+        {"input-buffer", required_argument, nullptr, OPT_INPUT_BUFFER},
+        {"tape-size", required_argument, nullptr, OPT_TAPE_SIZE},
+        {"tape-huge-pages", no_argument, nullptr, OPT_TAPE_HUGE_PAGES},
+        {"jit-cache", no_argument, nullptr, OPT_JIT_CACHE},
+        {"jit-cache-dir", required_argument, nullptr, OPT_JIT_CACHE_DIR},
+        {"jit-lazy", no_argument, nullptr, OPT_JIT_LAZY},
+        {"jit-threads", required_argument, nullptr, OPT_JIT_THREADS},
+        {"aot-runtime", required_argument, nullptr, OPT_AOT_RUNTIME},
+        {"pgo-instrument", no_argument, nullptr, OPT_PGO_INSTRUMENT},
+        {"pgo-use", required_argument, nullptr, OPT_PGO_USE},
+        {"march", required_argument, nullptr, OPT_MARCH},
+        {"mattr", required_argument, nullptr, OPT_MATTR},
         {"no-run", no_argument, nullptr, 'n'},
         {"run", no_argument, nullptr, 'r'},
         {"output", required_argument, nullptr, 'o'},
@@ -52,19 +136,40 @@ BfOption parseOptions(int argc, char *argv[])
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "nro:", longOptions, nullptr)) != -1)
+    while ((opt = getopt_long(argc, argv, "nro:O:", longOptions, nullptr)) != -1)
     {
         switch (opt)
         {
             case OPT_BF_INSN:
                 options.interpretBfInst = true;
                 break;
+            case OPT_THREADED:
+                options.interpretThreaded = true;
+                break;
+            case OPT_TIERED:
+                options.interpretTiered = true;
+                break;
+            case OPT_TIER_THRESHOLD:
+            {
+                char *end;
+                unsigned long threshold = strtoul(optarg, &end, 10);
+                if (optarg[0] < '0' || optarg[0] > '9' || *end != '\0' || threshold == 0 || threshold > UINT32_MAX)
+                {
+                    fprintf(stderr, "Error: Invalid tier threshold %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.tierThreshold = threshold;
+                break;
+            }
             case OPT_DIRECT:
                 options.interpretDirect = true;
                 break;
             case OPT_JIT:
                 options.interpretJit = true;
                 break;
+            case OPT_FAST_JIT:
+                options.interpretFastJit = true;
+                break;
             case OPT_AOT:
                 options.aot = true;
                 options.noRun = true;
@@ -75,6 +180,116 @@ BfOption parseOptions(int argc, char *argv[])
             case OPT_PRINT_ELAPSED:
                 options.printElapsed = true;
                 break;
+            case OPT_PASSES:
+                options.optPasses = optarg;
+                break;
+            case OPT_LLVM_OPT:
+                if (optarg[0] < '0' || optarg[0] > '3' || optarg[1] != '\0')
+                {
+                    fprintf(stderr, "Error: Invalid LLVM optimization level %s, expected 0 to 3.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.llvmOptLevel = optarg[0] - '0';
+                break;
+            case OPT_FLUSH:
+                if (strcmp(optarg, "full") == 0)
+                {
+                    options.flushPolicy = BF_FLUSH_FULL;
+                }
+                else if (strcmp(optarg, "line") == 0)
+                {
+                    options.flushPolicy = BF_FLUSH_LINE;
+                }
+                else if (strcmp(optarg, "read") == 0)
+                {
+                    options.flushPolicy = BF_FLUSH_READ;
+                }
+                else
+                {
+                    fprintf(stderr, "Error: Invalid flush policy %s, expected full, line or read.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_OUTPUT_BUFFER:
+                options.outputBufferSize = parseBufferSize("output buffer", optarg);
+                break;
+            case OPT_INPUT_BUFFER:
+                options.inputBufferSize = parseBufferSize("input buffer", optarg);
+                break;
+            case OPT_TAPE_SIZE:
+            {
+                char *end;
+                unsigned long size = strtoul(optarg, &end, 10);
+                if (optarg[0] < '0' || optarg[0] > '9' || *end != '\0' || (size & (size - 1)) != 0 ||
+                    size < BF_TAPE_MIN_SIZE || size > BF_TAPE_MAX_SIZE)
+                {
+                    fprintf(stderr, "Error: Invalid tape size %s, expected a power of two from %d to %d.\n",
+                            optarg, BF_TAPE_MIN_SIZE, BF_TAPE_MAX_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                options.tapeSize = size;
+                break;
+            }
+            case OPT_TAPE_HUGE_PAGES:
+                options.tapeHugePages = true;
+                break;
+            case OPT_JIT_CACHE:
+                options.jitCache = true;
+                break;
+            case OPT_JIT_CACHE_DIR:
+                options.jitCache = true;
+                options.jitCacheDir = optarg;
+                break;
+            case OPT_JIT_LAZY:
+                options.jitLazy = true;
+                break;
+            case OPT_JIT_THREADS:
+            {
+                char *end;
+                unsigned long threads = strtoul(optarg, &end, 10);
+                if (optarg[0] < '0' || optarg[0] > '9' || *end != '\0' || threads > 1024)
+                {
+                    fprintf(stderr, "Error: Invalid JIT thread count %s, expected 0 to 1024.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.jitThreads = threads;
+                break;
+            }
+            case OPT_AOT_RUNTIME:
+                if (strcmp(optarg, "libc") == 0)
+                {
+                    options.aotRuntime = BF_AOT_RUNTIME_LIBC;
+                }
+                else if (strcmp(optarg, "freestanding") == 0)
+                {
+                    options.aotRuntime = BF_AOT_RUNTIME_FREESTANDING;
+                }
+                else
+                {
+                    fprintf(stderr, "Error: Invalid AOT runtime %s, expected libc or freestanding.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PGO_INSTRUMENT:
+                options.pgoInstrument = true;
+                break;
+            case OPT_PGO_USE:
+                options.pgoProfile = optarg;
+                break;
+            case OPT_MARCH:
+                options.march = optarg;
+                break;
+            case OPT_MATTR:
+                options.mattr = optarg;
+                break;
+            case 'O':
+                if (optarg[0] < '0' || optarg[0] > '3' || optarg[1] != '\0')
+                {
+                    fprintf(stderr, "Error: Invalid optimization level -O%s, expected -O0 to -O3.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.optLevel = optarg[0] - '0';
+                break;
             case 'n':
                 options.noRun = true;
                 break;
@@ -93,12 +308,15 @@ BfOption parseOptions(int argc, char *argv[])
     {
         unsigned int modeCounter = 0;
         if (options.interpretBfInst) modeCounter++;
+        if (options.interpretThreaded) modeCounter++;
+        if (options.interpretTiered) modeCounter++;
         if (options.interpretDirect) modeCounter++;
         if (options.interpretJit) modeCounter++;
+        if (options.interpretFastJit) modeCounter++;
         if (options.aot) modeCounter++;
         if (modeCounter > 1)
         {
-            fprintf(stderr, "Error: Only one of --bf-insn, --direct, --jit, or --aot can be used.\n");
+            fprintf(stderr, "Error: Only one of --bf-insn, --threaded, --tiered, --direct, --jit, --fast-jit, or --aot can be used.\n");
             exit(EXIT_FAILURE);
         }
         if (!modeCounter)
@@ -113,6 +331,51 @@ BfOption parseOptions(int argc, char *argv[])
             fprintf(stderr, "Error: --emit-ir cannot be used with --direct.\n");
             exit(EXIT_FAILURE);
         }
+        if (options.jitCache && options.jitCacheDir.empty())
+        {
+            options.jitCacheDir = BfJitObjectCache::defaultDir();
+        }
+        if (options.jitCache && !options.interpretJit)
+        {
+            fprintf(stderr, "Error: --jit-cache and --jit-cache-dir can only be used with --jit.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (options.jitLazy && !options.interpretJit)
+        {
+            fprintf(stderr, "Error: --jit-lazy can only be used with --jit.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (options.jitThreads && !options.interpretJit)
+        {
+            fprintf(stderr, "Error: --jit-threads can only be used with --jit.\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((options.jitLazy || options.jitThreads) && options.jitCache)
+        {
+            fprintf(stderr, "Error: --jit-lazy and --jit-threads cannot be used with --jit-cache or --jit-cache-dir.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (options.aotRuntime != BF_AOT_RUNTIME_LIBC && !options.aot)
+        {
+            fprintf(stderr, "Error: --aot-runtime can only be used with --aot.\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((options.pgoInstrument || !options.pgoProfile.empty()) && !options.aot)
+        {
+            fprintf(stderr, "Error: --pgo-instrument and --pgo-use can only be used with --aot.\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((!options.march.empty() || !options.mattr.empty()) &&
+            !options.interpretJit && !options.interpretTiered && !options.aot)
+        {
+            fprintf(stderr, "Error: --march and --mattr can only be used with --jit, --tiered, or --aot.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (options.pgoInstrument && !options.pgoProfile.empty())
+        {
+            fprintf(stderr, "Error: --pgo-instrument cannot be used with --pgo-use.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if (optind + 1 != argc)
@@ -126,22 +389,54 @@ BfOption parseOptions(int argc, char *argv[])
 }
 
 
+// flushed by exit() as well, so output written before an error is kept
+static std::shared_ptr<BfRunner> runner;
+
+static void flushAtExit()
+{
+    if (runner)
+    {
+        runner->flushOutput();
+    }
+}
+
 int main(int argc, char *argv[])
 {
     BfOption options = parseOptions(argc, argv);
-    std::shared_ptr<BfRunner> runner;
 
     if (options.interpretBfInst)
     {
         runner = std::make_shared<BfRunnerBfInsn>();
     }
+    else if (options.interpretThreaded)
+    {
+        runner = std::make_shared<BfRunnerThreaded>();
+    }
+    else if (options.interpretTiered)
+    {
+        BfRunnerTiered *tiered = new BfRunnerTiered();
+        tiered->setLlvmOptLevel(options.llvmOptLevel);
+        tiered->setThreshold(options.tierThreshold);
+        tiered->setTarget(options.march, options.mattr);
+        runner = std::shared_ptr<BfRunner>(tiered);
+    }
     else if (options.interpretDirect)
     {
         runner = std::make_shared<BfRunnerDirect>();
     }
     else if (options.interpretJit)
     {
-        runner = std::make_shared<BfRunnerJit>();
+        BfRunnerJit *jit = new BfRunnerJit();
+        jit->setLlvmOptLevel(options.llvmOptLevel);
+        jit->setCacheDir(options.jitCacheDir);
+        jit->setLazy(options.jitLazy);
+        jit->setCompileThreads(options.jitThreads);
+        jit->setTarget(options.march, options.mattr);
+        runner = std::shared_ptr<BfRunner>(jit);
+    }
+    else if (options.interpretFastJit)
+    {
+        runner = std::make_shared<BfRunnerFastJit>();
     }
     else if (options.aot)
     {
@@ -152,6 +447,11 @@ int main(int argc, char *argv[])
         }
         BfCompiler *compiler = new BfCompiler();
         compiler->setOutputExecutablePath(options.outputExecutablePath);
+        compiler->setLlvmOptLevel(options.llvmOptLevel);
+        compiler->setRuntime(options.aotRuntime);
+        compiler->setPgoInstrument(options.pgoInstrument);
+        compiler->setPgoProfile(options.pgoProfile);
+        compiler->setTarget(options.march, options.mattr);
         runner = std::shared_ptr<BfRunner>(compiler);
     }
     else
@@ -161,6 +461,14 @@ int main(int argc, char *argv[])
     }
 
     runner->setEnableIrEmit(options.emitIr);
+    runner->setOptLevel(options.optLevel);
+    runner->setOptPasses(options.optPasses);
+    runner->setFlushPolicy(options.flushPolicy);
+    runner->setOutputBufferSize(options.outputBufferSize);
+    runner->setInputBufferSize(options.inputBufferSize);
+    runner->setTapeSize(options.tapeSize);
+    runner->setTapeHugePages(options.tapeHugePages);
+    atexit(flushAtExit);
 
     runner->setSourcePath(options.bfFile);
     runner->preprocessCode();
@@ -169,6 +477,7 @@ int main(int argc, char *argv[])
     if (!options.noRun)
     {
         runner->run();
+        runner->finishRun();
     }
 
     if (options.printElapsed)
@@ -0,0 +1,311 @@
+/*
+ * Runtime linked into every --aot executable: the entry point and the
+ * bf_io callbacks. bf_scan comes from bf_scan.cpp, built into the same
+ * archive. The generated object provides bfcode, the tape and the options
+ * below; --pgo-instrument builds also dump their loop counters at exit.
+ *
+ * Built twice: against libc with main(), and with BF_FREESTANDING for
+ * --aot-runtime=freestanding, where _start talks to the kernel directly
+ * and the executable is linked -nostdlib -static.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include "bf_io.h"
+#include "bf_pgo.h"
+#include "bf_scan.h"
+
+extern void bfcode(struct bf_io *io, uint8_t *memory, uint32_t (*scan)(const uint8_t *, uint32_t, int32_t, uint32_t));
+/* --tape-size zero cells in .bss, paged in on first touch */
+extern uint8_t bf_tape[];
+/* nonzero unless built with --flush=full */
+extern const int32_t bf_flush_before_read;
+/* only defined by --pgo-instrument builds */
+extern uint64_t bf_pgo_counters[] __attribute__((weak));
+extern const uint32_t bf_pgo_count __attribute__((weak));
+extern const uint64_t bf_pgo_hash __attribute__((weak));
+
+static uint8_t out_buf[BF_IO_BUF_SIZE];
+static uint8_t in_buf[BF_IO_BUF_SIZE];
+
+#ifdef BF_FREESTANDING
+
+#include <asm/unistd.h>
+
+static long bf_syscall4(long n, long a, long b, long c, long d)
+{
+    long ret;
+#if defined(__x86_64__)
+    register long r10 __asm__("r10") = d;
+    __asm__ volatile ("syscall"
+                      : "=a"(ret)
+                      : "a"(n), "D"(a), "S"(b), "d"(c), "r"(r10)
+                      : "rcx", "r11", "memory");
+#elif defined(__aarch64__)
+    register long x8 __asm__("x8") = n;
+    register long x0 __asm__("x0") = a;
+    register long x1 __asm__("x1") = b;
+    register long x2 __asm__("x2") = c;
+    register long x3 __asm__("x3") = d;
+    __asm__ volatile ("svc 0"
+                      : "+r"(x0)
+                      : "r"(x8), "r"(x1), "r"(x2), "r"(x3)
+                      : "memory");
+    ret = x0;
+#else
+#error "freestanding runtime: unsupported architecture"
+#endif
+    return ret;
+}
+
+#define bf_read(fd, buf, len) bf_syscall4(__NR_read, (fd), (long)(buf), (len), 0)
+#define bf_write(fd, buf, len) bf_syscall4(__NR_write, (fd), (long)(buf), (len), 0)
+#define bf_open(path, flags, mode) bf_syscall4(__NR_openat, AT_FDCWD, (long)(path), (flags), (mode))
+#define bf_close(fd) bf_syscall4(__NR_close, (fd), 0, 0, 0)
+
+static char **bf_environ;
+
+static const char *bf_getenv(const char *name)
+{
+    for (char **env = bf_environ; env && *env; env++)
+    {
+        const char *n = name;
+        const char *e = *env;
+        while (*n && *n == *e)
+        {
+            n++;
+            e++;
+        }
+        if (!*n && *e == '=')
+        {
+            return e + 1;
+        }
+    }
+    return NULL;
+}
+
+/* what the compiler and bf_scan may call without a libc */
+void *memset(void *dst, int c, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    while (n--)
+    {
+        *d++ = (uint8_t)c;
+    }
+    return dst;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    while (n--)
+    {
+        *d++ = *s++;
+    }
+    return dst;
+}
+
+void *memmove(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    if (d < s)
+    {
+        return memcpy(dst, src, n);
+    }
+    while (n--)
+    {
+        d[n] = s[n];
+    }
+    return dst;
+}
+
+void *memchr(const void *p, int c, size_t n)
+{
+    const uint8_t *s = (const uint8_t *)p;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (s[i] == (uint8_t)c)
+        {
+            return (void *)(s + i);
+        }
+    }
+    return NULL;
+}
+
+void *memrchr(const void *p, int c, size_t n)
+{
+    const uint8_t *s = (const uint8_t *)p;
+    while (n--)
+    {
+        if (s[n] == (uint8_t)c)
+        {
+            return (void *)(s + n);
+        }
+    }
+    return NULL;
+}
+
+#else
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define bf_read(fd, buf, len) read((fd), (buf), (len))
+#define bf_write(fd, buf, len) write((fd), (buf), (len))
+#define bf_open(path, flags, mode) open((path), (flags), (mode))
+#define bf_close(fd) close(fd)
+#define bf_getenv(name) getenv(name)
+
+#endif
+
+static void bf_flush(struct bf_io *io)
+{
+    const uint8_t *data = io->out;
+    uint32_t len = io->out_pos;
+    while (len > 0)
+    {
+        long n = bf_write(1, data, len);
+        if (n <= 0)
+        {
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    io->out_pos = 0;
+}
+
+static uint8_t bf_fill(struct bf_io *io)
+{
+    if (bf_flush_before_read)
+    {
+        bf_flush(io);
+    }
+    long n = bf_read(0, in_buf, sizeof(in_buf));
+    if (n <= 0)
+    {
+        io->in_pos = io->in_len = 0;
+        return 0;
+    }
+    io->in_pos = 1;
+    io->in_len = n;
+    return in_buf[0];
+}
+
+static int bf_write_all(int fd, const void *buf, uint32_t len)
+{
+    const uint8_t *data = (const uint8_t *)buf;
+    while (len > 0)
+    {
+        long n = bf_write(fd, data, len);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* add the counters of earlier runs of the same program, then rewrite */
+static void bf_pgo_dump(void)
+{
+    const char *path = bf_getenv(BF_PGO_PATH_ENV);
+    if (!path || !path[0])
+    {
+        path = BF_PGO_DEFAULT_PATH;
+    }
+
+    struct bf_pgo_header header;
+    int fd = bf_open(path, O_RDONLY, 0);
+    if (fd >= 0)
+    {
+        if (bf_read(fd, &header, sizeof(header)) == sizeof(header)
+            && header.magic[0] == 'B' && header.magic[1] == 'F' && header.magic[2] == 'P' && header.magic[3] == 'G'
+            && header.version == BF_PGO_VERSION && header.hash == bf_pgo_hash && header.count == bf_pgo_count)
+        {
+            uint64_t counter;
+            for (uint32_t i = 0; i < bf_pgo_count && bf_read(fd, &counter, sizeof(counter)) == sizeof(counter); i++)
+            {
+                bf_pgo_counters[i] += counter;
+            }
+        }
+        bf_close(fd);
+    }
+
+    fd = bf_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    header.magic[0] = 'B';
+    header.magic[1] = 'F';
+    header.magic[2] = 'P';
+    header.magic[3] = 'G';
+    header.version = BF_PGO_VERSION;
+    header.hash = bf_pgo_hash;
+    header.count = bf_pgo_count;
+    header.reserved = 0;
+    if (bf_write_all(fd, &header, sizeof(header)))
+    {
+        bf_write_all(fd, bf_pgo_counters, bf_pgo_count * sizeof(uint64_t));
+    }
+    bf_close(fd);
+}
+
+static void bf_main(void)
+{
+    struct bf_io io = {out_buf, 0, BF_IO_BUF_SIZE, in_buf, 0, 0, 0, bf_flush, bf_fill};
+    bfcode(&io, bf_tape, bf_scan);
+    bf_flush(&io);
+    if (bf_pgo_counters)
+    {
+        bf_pgo_dump();
+    }
+}
+
+#ifdef BF_FREESTANDING
+
+/* sp points at argc, argv[], NULL, envp[] */
+__attribute__((noreturn, used)) void bf_start(long *sp)
+{
+    bf_environ = (char **)(sp + 1 + sp[0] + 1);
+    bf_main();
+    for (;;)
+    {
+        bf_syscall4(__NR_exit_group, 0, 0, 0, 0);
+    }
+}
+
+/* align the stack and hand the initial one to bf_start */
+#if defined(__x86_64__)
+__asm__(".text\n"
+        ".global _start\n"
+        "_start:\n"
+        "    xor %ebp, %ebp\n"
+        "    mov %rsp, %rdi\n"
+        "    and $-16, %rsp\n"
+        "    call bf_start\n"
+        "    hlt\n");
+#elif defined(__aarch64__)
+__asm__(".text\n"
+        ".global _start\n"
+        "_start:\n"
+        "    mov x29, #0\n"
+        "    mov x30, #0\n"
+        "    mov x0, sp\n"
+        "    bl bf_start\n");
+#endif
+
+#else
+
+int main(void)
+{
+    bf_main();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "bf_bytecode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+bool bf_bytecode_is(const char *data, size_t size)
+{
+    return size >= 4 && memcmp(data, BF_BYTECODE_MAGIC, 4) == 0;
+}
+
+uint64_t bf_bytecode_checksum(const bf_insn *insns, size_t count)
+{
+    // FNV-1a over 32-bit words
+    const uint32_t *words = (const uint32_t *)insns;
+    size_t n = count * sizeof(bf_insn) / sizeof(uint32_t);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < n; i++)
+    {
+        hash ^= words[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+bool bf_bytecode_write(const std::string &path, const bf_insn *insns, size_t count)
+{
+    bf_bytecode_header header = {};
+    memcpy(header.magic, BF_BYTECODE_MAGIC, 4);
+    header.version = BF_BYTECODE_VERSION;
+    header.insn_size = sizeof(bf_insn);
+    header.count = (uint32_t)count;
+    header.checksum = bf_bytecode_checksum(insns, count);
+
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Cannot open file %s\n", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(insns, sizeof(bf_insn), count, fp) == count;
+    if (fclose(fp) != 0 || !ok)
+    {
+        fprintf(stderr, "Error: Cannot write file %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void bf_bytecode_fail(const char *reason)
+{
+    fprintf(stderr, "Error: Invalid bytecode, %s\n", reason);
+    exit(1);
+}
+
+const bf_insn *bf_bytecode_load(const char *data, size_t size, size_t *count)
+{
+    bf_bytecode_header header;
+    if (size < sizeof(header))
+    {
+        bf_bytecode_fail("truncated header");
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, BF_BYTECODE_MAGIC, 4) != 0)
+    {
+        bf_bytecode_fail("bad magic");
+    }
+    if (header.version != BF_BYTECODE_VERSION)
+    {
+        fprintf(stderr, "Error: Unsupported bytecode version %u, expected %u\n",
+                header.version, BF_BYTECODE_VERSION);
+        exit(1);
+    }
+    if (header.insn_size != sizeof(bf_insn))
+    {
+        fprintf(stderr, "Error: Unsupported bytecode instruction size %u, expected %zu\n",
+                header.insn_size, sizeof(bf_insn));
+        exit(1);
+    }
+    if ((size - sizeof(header)) / sizeof(bf_insn) != header.count
+        || (size - sizeof(header)) % sizeof(bf_insn) != 0)
+    {
+        bf_bytecode_fail("size does not match the instruction count");
+    }
+
+    const bf_insn *insns = (const bf_insn *)(data + sizeof(header));
+    if (bf_bytecode_checksum(insns, header.count) != header.checksum)
+    {
+        bf_bytecode_fail("checksum mismatch");
+    }
+
+    // the engines follow jumps blindly, so loops must pair up and nest
+    std::vector<uint32_t> open;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        const bf_insn &insn = insns[i];
+        if (insn.opcode < 0 || insn.opcode >= BF_INSN_MAX)
+        {
+            bf_bytecode_fail("unknown opcode");
+        }
+        if (insn.opcode == BF_INSN_LB)
+        {
+            open.push_back(i);
+        }
+        else if (insn.opcode == BF_INSN_LE)
+        {
+            if (open.empty() || (uint32_t)insn.operand != open.back()
+                || (uint32_t)insns[open.back()].operand != i)
+            {
+                bf_bytecode_fail("unmatched jump");
+            }
+            open.pop_back();
+        }
+    }
+    if (!open.empty())
+    {
+        bf_bytecode_fail("unmatched jump");
+    }
+
+    *count = header.count;
+    return insns;
+}
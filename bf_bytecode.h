@@ -0,0 +1,41 @@
+#ifndef __bf_bytecode_h__
+#define __bf_bytecode_h__
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include "bf_runner_bf_insn.h"
+
+/*
+ * .bfc: the optimized bf_insn stream, executable straight from an mmap.
+ *
+ *   bf_bytecode_header
+ *   bf_insn[count]       LB / LE operands are already linked
+ *
+ * Host byte order. None of the magic bytes is a bf command, so a .bfc is
+ * never mistaken for source.
+ */
+#define BF_BYTECODE_MAGIC "\x7f" "BFC"
+#define BF_BYTECODE_VERSION 1
+
+struct bf_bytecode_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t insn_size;  // sizeof(bf_insn)
+    uint32_t count;
+    uint64_t checksum;   // bf_bytecode_checksum() of the instructions
+};
+
+bool bf_bytecode_is(const char *data, size_t size);
+
+uint64_t bf_bytecode_checksum(const bf_insn *insns, size_t count);
+
+// Write <path>, prints an error and returns false on failure.
+bool bf_bytecode_write(const std::string &path, const bf_insn *insns, size_t count);
+
+// Validate a mapped .bfc and return its instructions in place. Prints an
+// error and exits on a bad header, checksum or jump.
+const bf_insn *bf_bytecode_load(const char *data, size_t size, size_t *count);
+
+#endif
@@ -1,135 +1,242 @@
 #include "bf_compiler.h"
+#include "bf_bytecode.h"
 #include "bf_llvm_ir.h"
+#include "bf_pgo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetOptions.h"
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
-static const std::string mainCode = R"(
-#include <stdio.h>
-#include <stdint.h>
+// prebuilt by CMake: main or _start, the bf_io callbacks and bf_scan
+#ifndef BF_AOT_RUNTIME_LIB
+#define BF_AOT_RUNTIME_LIB "libbf_aot_runtime.a"
+#endif
+#ifndef BF_AOT_RUNTIME_FREESTANDING_LIB
+#define BF_AOT_RUNTIME_FREESTANDING_LIB "libbf_aot_runtime_freestanding.a"
+#endif
 
-#define MEM_SIZE (1 << 20)
-static uint8_t memory[MEM_SIZE];
-
-typedef uint8_t (*readbyte_func)(void *);
-typedef void (*writebyte_func)(void *, char);
-
-extern void bfcode(void *ctx, void *memory, readbyte_func readbyte, writebyte_func writebyte);
-
-static void bf_writebyte(void *ctx, char c)
+static std::unique_ptr<llvm::TargetMachine> createTargetMachine(llvm::Module &module, const BfLlvmTarget &cpu)
 {
-    putchar(c);
-}
+    std::string triple = llvm::sys::getDefaultTargetTriple();
+    std::string error;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target)
+    {
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        exit(1);
+    }
 
-static uint8_t bf_readbyte(void *ctx)
-{
-    int ch = getchar();
-    if (ch == EOF)
+    llvm::TargetOptions options;
+    std::unique_ptr<llvm::TargetMachine> tm(target->createTargetMachine(
+        triple, cpu.cpu, cpu.features, options, llvm::Reloc::PIC_, llvm::None, llvm::CodeGenOpt::Aggressive));
+    if (!tm)
     {
-        return 0;
+        fprintf(stderr, "Error: Cannot create target machine for %s\n", triple.c_str());
+        exit(1);
     }
-    return (uint8_t)ch;
+    module.setTargetTriple(triple);
+    module.setDataLayout(tm->createDataLayout());
+    return tm;
 }
 
-int main()
+static void emitObject(llvm::TargetMachine &tm, llvm::Module &module, int fd)
 {
-    void *ctx = NULL;
-    bfcode(ctx, memory, bf_readbyte, bf_writebyte);
-    return 0;
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/false);
+    llvm::legacy::PassManager pm;
+    if (tm.addPassesToEmitFile(pm, os, nullptr, llvm::CGFT_ObjectFile))
+    {
+        fprintf(stderr, "Error: Target cannot emit object files\n");
+        exit(1);
+    }
+    pm.run(module);
+    os.flush();
+    if (os.has_error())
+    {
+        os.clear_error();
+        fprintf(stderr, "Error: Cannot write object file\n");
+        exit(1);
+    }
 }
-)";
 
-static void clangCompile(const std::string main, const std::string &llvmIr, const std::string outputPath)
+// run argv[0] from $PATH without a shell, returns its exit status
+static int spawn(const std::vector<std::string> &args)
 {
-    const char *cc, *cflags;
-    char mainTemplate[] = "/tmp/mainXXXXXX.c"; // 后缀 ".c" 长度为2
-    char llvmTemplate[] = "/tmp/llvmXXXXXX.ll"; // 后缀 ".ll" 长度为3
-    std::string clangCmd;
-    int ret = 0;
-
-    int mainFd = -1;
-    int llvmFd = -1;
-
-    if ((mainFd = mkostemps(mainTemplate, 2, O_RDWR)) == -1)
+    std::vector<char *> argv;
+    for (const std::string &arg : args)
     {
-        perror("mkstemp");
-        goto err;
+        argv.push_back((char *)arg.c_str());
     }
+    argv.push_back(nullptr);
 
-    if ((llvmFd = mkostemps(llvmTemplate, 3, O_RDWR)) == -1)
+    pid_t pid = fork();
+    if (pid < 0)
     {
-        perror("mkstemp");
-        goto err;
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
     }
 
-    write(mainFd, main.c_str(), main.size());
-    write(llvmFd, llvmIr.c_str(), llvmIr.size());
-    close(mainFd);
-    close(llvmFd);
-    mainFd = -1;
-    llvmFd = -1;
-
-    cc = getenv("CC");
-    cflags = getenv("CFLAGS");
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
 
-    if (cc == NULL)
+// only the link step runs outside: $CC as the driver, $LDFLAGS appended
+static void linkExecutable(const std::string &object, const std::string &outputPath, BfAotRuntime runtime)
+{
+    const char *cc = getenv("CC");
+    const char *ldflags = getenv("LDFLAGS");
+    std::vector<std::string> args = {cc && cc[0] ? cc : "cc", "-o", outputPath, object};
+    if (runtime == BF_AOT_RUNTIME_FREESTANDING)
     {
-        cc = "clang";
+        // libgcc for __builtin_cpu_supports in bf_scan
+        args.insert(args.end(), {BF_AOT_RUNTIME_FREESTANDING_LIB, "-nostdlib", "-static", "-no-pie", "-lgcc"});
     }
-    if (cflags == NULL)
+    else
     {
-        cflags = "";
+        args.push_back(BF_AOT_RUNTIME_LIB);
+    }
+    if (ldflags)
+    {
+        std::string flags = ldflags;
+        for (char *flag = strtok(&flags[0], " \t"); flag; flag = strtok(nullptr, " \t"))
+        {
+            args.push_back(flag);
+        }
     }
 
-    clangCmd = std::string(cc) + " " + cflags + " " + llvmTemplate + " " + mainTemplate + " -o " + outputPath;
-
-    ret = system(clangCmd.c_str());
-    unlink(mainTemplate);
-    unlink(llvmTemplate);
-
+    int ret = spawn(args);
     if (ret != 0)
     {
-        fprintf(stderr, "Error: clang command failed with code %d\n", ret);
+        fprintf(stderr, "Error: Link command failed with code %d\n", ret);
+        exit(1);
+    }
+}
+
+// Read the counters of a --pgo-instrument run. A profile of a different
+// program is ignored with a warning, anything unreadable is an error.
+static bool loadProfile(const std::string &path, uint64_t hash, std::vector<uint64_t> &counters)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Cannot open profile %s\n", path.c_str());
         exit(1);
     }
 
-    return;
-err:
-    if (mainFd != -1)
+    bf_pgo_header header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1
+        && memcmp(header.magic, BF_PGO_MAGIC, 4) == 0
+        && header.version == BF_PGO_VERSION;
+    if (ok)
+    {
+        counters.resize(header.count);
+        ok = fread(counters.data(), sizeof(uint64_t), header.count, fp) == header.count;
+    }
+    fclose(fp);
+    if (!ok)
     {
-        close(mainFd);
-        unlink(mainTemplate);
+        fprintf(stderr, "Error: Invalid profile %s\n", path.c_str());
+        exit(1);
     }
-    if (llvmFd != -1)
+
+    if (header.hash != hash)
     {
-        close(llvmFd);
-        unlink(llvmTemplate);
+        fprintf(stderr, "Warning: Profile %s is for a different program, ignored\n", path.c_str());
+        counters.clear();
+        return false;
     }
-    exit(1);
+    return true;
 }
 
 void BfCompiler::compileCode()
 {
     BfRunnerBfInsn::compileCode();
+    bfLlvmInitialize();
+
+    if (mOutputExecutablePath.empty())
+    {
+        fprintf(stderr, "Error: Output executable path is not set\n");
+        exit(1);
+    }
+
+    // profiles belong to the optimized program, so -O and --passes matter
+    uint64_t programHash = bf_bytecode_checksum(mProgram, mProgramSize);
+    std::vector<uint64_t> counters;
+    BfLlvmIrOptions irOptions;
+    irOptions.lineFlush = getFlushPolicy() == BF_FLUSH_LINE;
+    irOptions.tapeSize = getTapeSize();
+    irOptions.pgoInstrument = mPgoInstrument;
+    if (!mPgoProfile.empty() && loadProfile(mPgoProfile, programHash, counters))
+    {
+        irOptions.pgoCounters = &counters;
+    }
 
     mTimer.start("GEN llvm-ir");
-    std::string llvmIr = bfLlvmIrGenerate(mInsns);
+    llvm::LLVMContext context;
+    context.setDiscardValueNames(!mEnableIrEmit);
+    auto module = bfLlvmIrGenerate(mProgram, mProgramSize, context, irOptions);
+    llvm::Type *i32 = llvm::Type::getInt32Ty(context);
+    new llvm::GlobalVariable(*module, i32, true, llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantInt::get(i32, getFlushPolicy() != BF_FLUSH_FULL), "bf_flush_before_read");
+    llvm::ArrayType *tapeTy = llvm::ArrayType::get(llvm::Type::getInt8Ty(context), getTapeSize());
+    llvm::GlobalVariable *tape = new llvm::GlobalVariable(*module, tapeTy, false, llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantAggregateZero::get(tapeTy), "bf_tape");
+    tape->setAlignment(llvm::Align(4096));
+    if (mPgoInstrument)
+    {
+        llvm::Type *i64 = llvm::Type::getInt64Ty(context);
+        new llvm::GlobalVariable(*module, i64, true, llvm::GlobalValue::ExternalLinkage,
+            llvm::ConstantInt::get(i64, programHash), "bf_pgo_hash");
+    }
     mTimer.stop();
 
     if (mEnableIrEmit)
     {
-        bfLlvmIrDumpToFile(mSourcePath, llvmIr);
+        bfLlvmIrDumpToFile(mSourcePath, *module);
     }
 
-    mTimer.start("GEN exe");
-    if (mOutputExecutablePath.empty())
+    // executables may run elsewhere, so "generic" unless asked otherwise
+    auto tm = createTargetMachine(*module, bfLlvmTarget(mMarch, mMattr));
+    if (mLlvmOptLevel > 0)
     {
-        fprintf(stderr, "Error: Output executable path is not set\n");
+        mTimer.start("AOT opt");
+        bfLlvmIrOptimize(*module, tm.get(), mLlvmOptLevel);
+        mTimer.stop();
+    }
+
+    mTimer.start("AOT codegen");
+    char objectTemplate[] = "/tmp/bfXXXXXX.o";
+    int objectFd = mkostemps(objectTemplate, 2, O_RDWR);
+    if (objectFd == -1)
+    {
+        perror("mkstemp");
         exit(1);
     }
-    clangCompile(mainCode, llvmIr, mOutputExecutablePath);
+    emitObject(*tm, *module, objectFd);
+    close(objectFd);
+    mTimer.stop();
+
+    mTimer.start("AOT link");
+    linkExecutable(objectTemplate, mOutputExecutablePath, mRuntime);
+    unlink(objectTemplate);
     mTimer.stop();
 }
 
@@ -4,6 +4,12 @@
 #include "bf_runner_bf_insn.h"
 #include <string>
 
+enum BfAotRuntime
+{
+    BF_AOT_RUNTIME_LIBC,
+    BF_AOT_RUNTIME_FREESTANDING,  // _start and raw syscalls, no libc
+};
+
 class BfCompiler : public BfRunnerBfInsn
 {
 public:
@@ -14,10 +20,50 @@ public:
     {
         mOutputExecutablePath = path;
     }
+
+    void setLlvmOptLevel(int level)
+    {
+        mLlvmOptLevel = level;
+    }
+
+    void setRuntime(BfAotRuntime runtime)
+    {
+        mRuntime = runtime;
+    }
+
+    // CPU and features to generate code for, see bfLlvmTarget(); an empty
+    // march keeps the default, generic
+    void setTarget(const std::string &march, const std::string &mattr)
+    {
+        if (!march.empty())
+        {
+            mMarch = march;
+        }
+        mMattr = mattr;
+    }
+
+    // executables count loop iterations into a profile, see bf_pgo.h
+    void setPgoInstrument(bool enable)
+    {
+        mPgoInstrument = enable;
+    }
+
+    // build with loop branch weights from a profile
+    void setPgoProfile(const std::string &path)
+    {
+        mPgoProfile = path;
+    }
+
     void compileCode() override;
     void run() override;
 private:
     std::string mOutputExecutablePath;
+    int mLlvmOptLevel {2};
+    BfAotRuntime mRuntime {BF_AOT_RUNTIME_LIBC};
+    std::string mMarch {"generic"};
+    std::string mMattr;
+    bool mPgoInstrument {false};
+    std::string mPgoProfile;
 };
 
 #endif // __bf_compiler_h__
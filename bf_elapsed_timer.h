@@ -12,6 +12,7 @@ struct BfElapsedRecord
     std::string name;
     std::chrono::steady_clock::time_point start;
     std::chrono::steady_clock::time_point end;
+    std::string note;
 };
 
 struct BfElapsedTimer
@@ -30,6 +31,23 @@ struct BfElapsedTimer
         mRecords.back().end = std::chrono::steady_clock::now();
     }
 
+    // add a record for time measured elsewhere, e.g. inside a callback
+    void record(const char *name, std::chrono::steady_clock::duration elapsed)
+    {
+        auto now = std::chrono::steady_clock::now();
+        mRecords.push_back({name, now - elapsed, now, std::string()});
+    }
+
+    // attach extra information to the last record
+    void note(const std::string &text)
+    {
+        if (mRecords.empty())
+        {
+            throw std::runtime_error("No timer started");
+        }
+        mRecords.back().note = text;
+    }
+
     static std::string nanosecondToString(uint64_t ns)
     {
         const char *units[] = {"us", "ms", "sec"};
@@ -60,7 +78,14 @@ struct BfElapsedTimer
         {
             uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(record.end - record.start).count();
             std::string elapsedTime = nanosecondToString(ns);
-            fprintf(stderr, "%12s: %s\n", record.name.c_str(), elapsedTime.c_str());
+            if (record.note.empty())
+            {
+                fprintf(stderr, "%12s: %s\n", record.name.c_str(), elapsedTime.c_str());
+            }
+            else
+            {
+                fprintf(stderr, "%12s: %s (%s)\n", record.name.c_str(), elapsedTime.c_str(), record.note.c_str());
+            }
         }
     }
 
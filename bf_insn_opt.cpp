@@ -0,0 +1,272 @@
+#include "bf_insn_opt.h"
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const bf_insn_pass sPasses[] =
+{
+    {"clear", 1, bf_insn_opt_clear_loops},
+    {"mul", 2, bf_insn_opt_mul_loops},
+    {"scan", 1, bf_insn_opt_scan_loops},
+    {"offset", 3, bf_insn_opt_offsets},
+};
+
+std::vector<const bf_insn_pass *> bf_insn_opt_pipeline(int level)
+{
+    std::vector<const bf_insn_pass *> passes;
+    for (const bf_insn_pass &pass : sPasses)
+    {
+        if (pass.level <= level)
+        {
+            passes.push_back(&pass);
+        }
+    }
+    return passes;
+}
+
+bool bf_insn_opt_parse_passes(const std::string &list, std::vector<const bf_insn_pass *> &passes)
+{
+    std::istringstream is(list);
+    std::string name;
+
+    while (std::getline(is, name, ','))
+    {
+        const bf_insn_pass *found = nullptr;
+        for (const bf_insn_pass &pass : sPasses)
+        {
+            if (name == pass.name)
+            {
+                found = &pass;
+                break;
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "Error: Unknown pass '%s', expected one of:", name.c_str());
+            for (const bf_insn_pass &pass : sPasses)
+            {
+                fprintf(stderr, " %s", pass.name);
+            }
+            fprintf(stderr, "\n");
+            return false;
+        }
+        passes.push_back(found);
+    }
+    return true;
+}
+
+void bf_insn_link(std::vector<bf_insn> &insns)
+{
+    std::vector<int32_t> lb_positions;
+
+    for (int32_t pos = 0; pos < (int32_t)insns.size(); pos++)
+    {
+        if (insns[pos].opcode == BF_INSN_LB)
+        {
+            lb_positions.push_back(pos);
+        }
+        else if (insns[pos].opcode == BF_INSN_LE)
+        {
+            if (lb_positions.empty())
+            {
+                fprintf(stderr, "Error: Unmatched ']' in source code\n");
+                exit(1);
+            }
+            int32_t lb_pos = lb_positions.back();
+            lb_positions.pop_back();
+            insns[lb_pos].operand = pos;
+            insns[pos].operand = lb_pos;
+        }
+    }
+
+    if (!lb_positions.empty())
+    {
+        fprintf(stderr, "Error: Unmatched '[' in source code\n");
+        exit(1);
+    }
+}
+
+void bf_insn_opt_clear_loops(std::vector<bf_insn> &insns)
+{
+    std::vector<bf_insn> out;
+
+    out.reserve(insns.size());
+    for (const bf_insn &insn : insns)
+    {
+        size_t n = out.size();
+
+        // [-] / [+]: any odd step reaches zero
+        if (insn.opcode == BF_INSN_LE && n >= 2 && out[n - 2].opcode == BF_INSN_LB &&
+            out[n - 1].opcode == BF_INSN_VA && out[n - 1].offset == 0 && (out[n - 1].operand & 1))
+        {
+            out.resize(n - 2);
+            // a preceding update of the same cell is overwritten
+            while (!out.empty() && (out.back().opcode == BF_INSN_VA || out.back().opcode == BF_INSN_SET) &&
+                   out.back().offset == 0)
+            {
+                out.pop_back();
+            }
+            out.push_back({BF_INSN_SET, 0, 0, 0});
+            continue;
+        }
+
+        if (insn.opcode == BF_INSN_VA && n >= 1 && out[n - 1].opcode == BF_INSN_SET && out[n - 1].offset == insn.offset)
+        {
+            out[n - 1].operand = (out[n - 1].operand + insn.operand) & 0xff;
+            continue;
+        }
+        out.push_back(insn);
+    }
+
+    bf_insn_link(out);
+    insns.swap(out);
+}
+
+// Try to turn insns[lb_pos..] (an LB followed by its body, LE not yet
+// appended) into MUL + SET. Returns false if the loop does not qualify.
+static bool bf_insn_rewrite_mul_loop(std::vector<bf_insn> &insns, size_t lb_pos)
+{
+    std::map<int32_t, int32_t> deltas;
+    int32_t offset = 0;
+
+    for (size_t pos = lb_pos + 1; pos < insns.size(); pos++)
+    {
+        const bf_insn &insn = insns[pos];
+        if (insn.opcode == BF_INSN_AA)
+        {
+            offset += insn.operand;
+        }
+        else if (insn.opcode == BF_INSN_VA)
+        {
+            deltas[offset + insn.offset] += insn.operand;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    if (offset != 0)
+    {
+        return false;
+    }
+
+    // the loop runs cell times for a -1 step and (256 - cell) times for +1
+    int32_t step = deltas[0] & 0xff;
+    int32_t sign;
+    if (step == 0xff)
+    {
+        sign = 1;
+    }
+    else if (step == 1)
+    {
+        sign = -1;
+    }
+    else
+    {
+        return false;
+    }
+
+    insns.resize(lb_pos);
+    for (const auto &delta : deltas)
+    {
+        int32_t factor = (delta.second * sign) & 0xff;
+        if (delta.first != 0 && factor != 0)
+        {
+            insns.push_back({BF_INSN_MUL, factor, 0, delta.first});
+        }
+    }
+    insns.push_back({BF_INSN_SET, 0, 0, 0});
+    return true;
+}
+
+void bf_insn_opt_mul_loops(std::vector<bf_insn> &insns)
+{
+    std::vector<bf_insn> out;
+    std::vector<size_t> lb_positions;
+
+    out.reserve(insns.size());
+    for (const bf_insn &insn : insns)
+    {
+        if (insn.opcode == BF_INSN_LB)
+        {
+            lb_positions.push_back(out.size());
+        }
+        else if (insn.opcode == BF_INSN_LE)
+        {
+            size_t lb_pos = lb_positions.back();
+            lb_positions.pop_back();
+            if (bf_insn_rewrite_mul_loop(out, lb_pos))
+            {
+                continue;
+            }
+        }
+        out.push_back(insn);
+    }
+
+    bf_insn_link(out);
+    insns.swap(out);
+}
+
+void bf_insn_opt_scan_loops(std::vector<bf_insn> &insns)
+{
+    std::vector<bf_insn> out;
+
+    out.reserve(insns.size());
+    for (const bf_insn &insn : insns)
+    {
+        size_t n = out.size();
+        if (insn.opcode == BF_INSN_LE && n >= 2 &&
+            out[n - 2].opcode == BF_INSN_LB && out[n - 1].opcode == BF_INSN_AA)
+        {
+            int32_t stride = out[n - 1].operand;
+            out.resize(n - 2);
+            out.push_back({BF_INSN_SCAN, stride, 0, 0});
+            continue;
+        }
+        out.push_back(insn);
+    }
+
+    bf_insn_link(out);
+    insns.swap(out);
+}
+
+void bf_insn_opt_offsets(std::vector<bf_insn> &insns)
+{
+    std::vector<bf_insn> out;
+    int32_t pending = 0;
+
+    out.reserve(insns.size());
+    for (bf_insn insn : insns)
+    {
+        switch (insn.opcode)
+        {
+            case BF_INSN_AA:
+                pending += insn.operand;
+                continue;
+            case BF_INSN_VA:
+            case BF_INSN_VI:
+            case BF_INSN_VO:
+            case BF_INSN_SET:
+                insn.offset += pending;
+                break;
+            case BF_INSN_MUL:
+                insn.offset += pending;
+                insn.target += pending;
+                break;
+            default:
+                // loops and scans look at addr itself
+                if (pending != 0)
+                {
+                    out.push_back({BF_INSN_AA, pending, 0, 0});
+                    pending = 0;
+                }
+                break;
+        }
+        out.push_back(insn);
+    }
+
+    bf_insn_link(out);
+    insns.swap(out);
+}
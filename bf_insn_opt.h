@@ -0,0 +1,40 @@
+#ifndef __bf_insn_opt_h__
+#define __bf_insn_opt_h__
+
+#include <string>
+#include <vector>
+#include "bf_runner_bf_insn.h"
+
+struct bf_insn_pass
+{
+    const char *name;
+    int level; // lowest -O level that runs the pass
+    void (*run)(std::vector<bf_insn> &insns);
+};
+
+// Passes enabled at -O<level>, in pipeline order.
+std::vector<const bf_insn_pass *> bf_insn_opt_pipeline(int level);
+
+// Parse a comma separated --passes= list. Prints an error and returns
+// false on an unknown pass name.
+bool bf_insn_opt_parse_passes(const std::string &list, std::vector<const bf_insn_pass *> &passes);
+
+// Recompute LB/LE jump operands after a pass changed instruction positions.
+void bf_insn_link(std::vector<bf_insn> &insns);
+
+// Replace [-] / [+] with SET 0 and fold +/- into a preceding SET.
+void bf_insn_opt_clear_loops(std::vector<bf_insn> &insns);
+
+// Rewrite balanced, I/O free loops that step the loop cell by -1 or +1
+// into MUL instructions followed by SET 0.
+void bf_insn_opt_mul_loops(std::vector<bf_insn> &insns);
+
+// Rewrite loops whose body is a single pointer move ([>], [<<], ...) into SCAN.
+void bf_insn_opt_scan_loops(std::vector<bf_insn> &insns);
+
+// Fold the pointer moves of each straight-line block into the offset of
+// the instructions that access cells, leaving one AA before the next
+// loop boundary or scan.
+void bf_insn_opt_offsets(std::vector<bf_insn> &insns);
+
+#endif
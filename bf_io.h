@@ -0,0 +1,29 @@
+#ifndef __bf_io_h__
+#define __bf_io_h__
+
+#include <stdint.h>
+
+#define BF_IO_BUF_SIZE (1 << 16)
+
+/*
+ * Buffered I/O state handed to generated code. '.' appends to out and
+ * ',' consumes in without leaving the generated function; the callbacks
+ * only run when out is full or in is drained. The layout is mirrored by
+ * bfLlvmIrGenerate and by the AOT runtime.
+ */
+struct bf_io
+{
+    uint8_t *out;
+    uint32_t out_pos;
+    uint32_t out_cap;
+    const uint8_t *in;
+    uint32_t in_pos;
+    uint32_t in_len;
+    void *user;
+    // writes out[0, out_pos) and resets out_pos
+    void (*flush)(struct bf_io *io);
+    // flushes out, refills in and returns its first byte, 0 at EOF
+    uint8_t (*fill)(struct bf_io *io);
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "bf_jit_cache.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace llvm;
+
+BfJitObjectCache::BfJitObjectCache(const std::string &dir)
+    : mDir(dir)
+{
+}
+
+std::string BfJitObjectCache::defaultDir()
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0])
+    {
+        return std::string(xdg) + "/bf";
+    }
+    const char *home = getenv("HOME");
+    if (home && home[0])
+    {
+        return std::string(home) + "/.cache/bf";
+    }
+    return "/tmp/bf-cache";
+}
+
+std::string BfJitObjectCache::makeKey(const char *source, size_t size, const std::string &options)
+{
+    uint64_t sourceHash = xxHash64(StringRef(source, size));
+    std::string key = options + "\n" + utohexstr(sourceHash) + "\n" + std::to_string(size);
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)xxHash64(key));
+    return name;
+}
+
+std::string BfJitObjectCache::path() const
+{
+    return mDir + "/" + mKey + ".o";
+}
+
+std::unique_ptr<MemoryBuffer> BfJitObjectCache::load()
+{
+    auto buffer = MemoryBuffer::getFile(path(), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
+    {
+        return nullptr;
+    }
+    auto object = object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+    if (!object)
+    {
+        errs() << "Warning: Ignoring bad JIT cache entry " << path() << ": " << toString(object.takeError()) << "\n";
+        remove();
+        return nullptr;
+    }
+    return std::move(*buffer);
+}
+
+void BfJitObjectCache::remove()
+{
+    sys::fs::remove(path());
+}
+
+void BfJitObjectCache::notifyObjectCompiled(const Module *, MemoryBufferRef Obj)
+{
+    if (auto ec = sys::fs::create_directories(mDir))
+    {
+        errs() << "Warning: Cannot create JIT cache directory " << mDir << ": " << ec.message() << "\n";
+        return;
+    }
+
+    // write to a private file first so concurrent runs never see half an object
+    int fd;
+    SmallString<128> tmp;
+    if (sys::fs::createUniqueFile(mDir + "/" + mKey + "-%%%%%%.tmp", fd, tmp))
+    {
+        errs() << "Warning: Cannot write JIT cache in " << mDir << "\n";
+        return;
+    }
+    raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os << Obj.getBuffer();
+    os.close();
+    if (os.has_error())
+    {
+        os.clear_error();
+        sys::fs::remove(tmp);
+        return;
+    }
+    if (sys::fs::rename(tmp, path()))
+    {
+        sys::fs::remove(tmp);
+    }
+}
+
+std::unique_ptr<MemoryBuffer> BfJitObjectCache::getObject(const Module *)
+{
+    return load();
+}
@@ -0,0 +1,44 @@
+#ifndef __bf_jit_cache_h__
+#define __bf_jit_cache_h__
+
+#include <memory>
+#include <string>
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/*
+ * Compiled bfcode objects on disk, one <key>.o per program. The key is
+ * chosen by the runner and covers everything that changes the object:
+ * the preprocessed source, optimization options and target CPU.
+ */
+class BfJitObjectCache : public llvm::ObjectCache
+{
+public:
+    explicit BfJitObjectCache(const std::string &dir);
+
+    // $XDG_CACHE_HOME/bf or ~/.cache/bf
+    static std::string defaultDir();
+    static std::string makeKey(const char *source, size_t size, const std::string &options);
+
+    void setKey(const std::string &key)
+    {
+        mKey = key;
+    }
+
+    // the entry for the key, nullptr on a miss; an entry that is not an
+    // object file is removed and counts as a miss
+    std::unique_ptr<llvm::MemoryBuffer> load();
+    // drop the entry for the key, e.g. when it cannot be linked
+    void remove();
+
+    void notifyObjectCompiled(const llvm::Module *, llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *) override;
+
+private:
+    std::string path() const;
+
+    std::string mDir;
+    std::string mKey;
+};
+
+#endif
@@ -1,139 +1,609 @@
 
 #include "bf_llvm_ir.h"
-#include <sstream>
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-static void bf_llvm_ir_emit_va(std::ostream &os, unsigned int ninst, int operand)
-{
-    os << "inst" << ninst << ":\n";
-    os << "  ; VA " << operand << "\n";
-    os << "  %inst" << ninst << "_addr = load i32, i32* %addr\n";
-    os << "  %inst" << ninst << "_mem = getelementptr i8, i8* %memory, i32 %inst" << ninst << "_addr\n";
-    os << "  %inst" << ninst << "_val = load i8, i8* %inst" << ninst << "_mem\n";
-    os << "  %inst" << ninst << "_val2 = add i8 %inst" << ninst << "_val, " << operand << "\n";
-    os << "  store i8 %inst" << ninst << "_val2, i8* %inst" << ninst << "_mem\n";
-    os << "  br label %inst" << (ninst + 1) << "\n";
-}
+using namespace llvm;
 
-static void bf_llvm_ir_emit_aa(std::ostream &os, unsigned int ninst, int operand)
+/*
+ * Generated function:
+ *   void bfcode(%bf_io *io, i8 *memory, i32 (*scan)(i8 *, i32, i32, i32))
+ * addr is an SSA value: every loop gets a preheader, a header with a phi
+ * merging addr from the preheader and the latch, a body and an exit.
+ * memory is noalias and dereferenceable for the whole tape, so cells can
+ * stay in registers across the I/O callbacks.
+ * '.' and ',' work on the bf_io buffers inline and only call io->flush or
+ * io->fill on the slow path; the caller flushes what is left on return.
+ * With lineFlush every '\n' written also calls io->flush.
+ * Loops are numbered in '[' order for the PGO counters and weights.
+ *
+ * A single loop can also be generated on its own as
+ *   i32 name(%bf_io *io, i8 *memory, i32 (*scan)(i8 *, i32, i32, i32), i32 addr)
+ * which runs the loop from its header and returns addr after the exit.
+ * With outlineLoops every top-level loop of bfcode is such a function,
+ * bfloop_<index of '['>, in the same module and called from bfcode, or
+ * with declareLoops just declared there and generated separately.
+ */
+struct BfLlvmIrGen
 {
-    os << "inst" << ninst << ":\n";
-    os << "  ; AA " << operand << "\n";
-    os << "  %inst" << ninst << "_addr = load i32, i32* %addr\n";
-    os << "  %inst" << ninst << "_addr2 = add i32 %inst" << ninst << "_addr, " << operand << "\n";
-    os << "  %inst" << ninst << "_addr3 = and i32 %inst" << ninst << "_addr2, " << BF_ADDR_MASK << "\n";
-    os << "  store i32 %inst" << ninst << "_addr3, i32* %addr\n";
-    os << "  br label %inst" << (ninst + 1) << "\n";
-}
+    BfLlvmIrGen(LLVMContext &context, Module &module, const BfLlvmIrOptions &options, unsigned numLoops,
+                const char *name = "bfcode", bool loopFunction = false)
+        : ctx(context), builder(context), flushLines(options.lineFlush), pgoCounts(options.pgoCounters),
+          returnsAddr(loopFunction), mask(options.tapeSize - 1)
+    {
+        Type *i8p = Type::getInt8PtrTy(ctx);
+        i8 = Type::getInt8Ty(ctx);
+        i32 = Type::getInt32Ty(ctx);
+        // struct bf_io, see bf_io.h, shared by all functions in the context
+        ioTy = StructType::getTypeByName(ctx, "bf_io");
+        bool newIoTy = !ioTy;
+        if (newIoTy)
+        {
+            ioTy = StructType::create(ctx, "bf_io");
+        }
+        Type *ioPtr = ioTy->getPointerTo();
+        flushTy = FunctionType::get(Type::getVoidTy(ctx), {ioPtr}, false);
+        fillTy = FunctionType::get(i8, {ioPtr}, false);
+        if (newIoTy)
+        {
+            ioTy->setBody({i8p, i32, i32, i8p, i32, i32, i8p, flushTy->getPointerTo(), fillTy->getPointerTo()});
+        }
+        scanTy = FunctionType::get(i32, {i8p, i32, i32, i32}, false);
 
-static void bf_llvm_ir_emit_lb(std::ostream &os, unsigned int ninst, int operand)
-{
-    os << "inst" << ninst << ":\n";
-    os << "  ; LB " << operand << "\n";
-    os << "  %inst" << ninst << "_addr = load i32, i32* %addr\n";
-    os << "  %inst" << ninst << "_mem = getelementptr i8, i8* %memory, i32 %inst" << ninst << "_addr\n";
-    os << "  %inst" << ninst << "_val = load i8, i8* %inst" << ninst << "_mem\n";
-    os << "  %inst" << ninst << "_cond = icmp eq i8 %inst" << ninst << "_val, 0\n";
-    os << "  br i1 %inst" << ninst << "_cond, label %inst" << (operand + 1) << ", label %inst" << (ninst + 1) << "\n";
-}
+        std::vector<Type *> params = {ioPtr, i8p, scanTy->getPointerTo()};
+        if (returnsAddr)
+        {
+            params.push_back(i32);
+        }
+        FunctionType *funcTy = FunctionType::get(returnsAddr ? i32 : Type::getVoidTy(ctx), params, false);
+        func = Function::Create(funcTy, Function::ExternalLinkage, name, module);
 
-static void bf_llvm_ir_emit_le(std::ostream &os, unsigned int ninst, int operand)
-{
-    os << "inst" << ninst << ":\n";
-    os << "  ; LE " << operand << "\n";
-    os << "  br label %inst" << operand << "\n";
-}
+        auto arg = func->arg_begin();
+        io = arg++;
+        memory = arg++;
+        scan = arg++;
+        io->setName("io");
+        memory->setName("memory");
+        scan->setName("scan");
+
+        func->addFnAttr(Attribute::NoUnwind);
+        func->addParamAttr(1, Attribute::NoAlias);
+        func->addParamAttr(1, Attribute::getWithDereferenceableBytes(ctx, options.tapeSize));
+
+        if (options.pgoInstrument)
+        {
+            Type *i64 = Type::getInt64Ty(ctx);
+            ArrayType *countersTy = ArrayType::get(i64, 2 * numLoops);
+            pgoCounters = new GlobalVariable(module, countersTy, false, GlobalValue::ExternalLinkage,
+                                             ConstantAggregateZero::get(countersTy), "bf_pgo_counters");
+            new GlobalVariable(module, i32, true, GlobalValue::ExternalLinkage,
+                               builder.getInt32(2 * numLoops), "bf_pgo_count");
+        }
+
+        builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", func));
+        if (returnsAddr)
+        {
+            addr = arg;
+            addr->setName("addr");
+        }
+        else
+        {
+            addr = builder.getInt32(0);
+        }
+    }
+
+    void countEvent(unsigned counter)
+    {
+        Type *i64 = builder.getInt64Ty();
+        Value *ptr = builder.CreateConstInBoundsGEP2_32(pgoCounters->getValueType(), pgoCounters, 0, counter);
+        builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i64, ptr), builder.getInt64(1)), ptr);
+    }
+
+    // {exit, body} weights of the loop header branch, from the profile
+    MDNode *loopWeights(unsigned index)
+    {
+        uint64_t iterations = (*pgoCounts)[2 * index];
+        uint64_t exits = (*pgoCounts)[2 * index + 1];
+        // branch weights are 32 bit
+        while (iterations > UINT32_MAX || exits > UINT32_MAX)
+        {
+            iterations >>= 1;
+            exits >>= 1;
+        }
+        return MDBuilder(ctx).createBranchWeights((uint32_t)exits, (uint32_t)iterations);
+    }
+
+    enum
+    {
+        IO_OUT,
+        IO_OUT_POS,
+        IO_OUT_CAP,
+        IO_IN,
+        IO_IN_POS,
+        IO_IN_LEN,
+        IO_USER,
+        IO_FLUSH,
+        IO_FILL,
+    };
+
+    Value *ioField(unsigned field)
+    {
+        return builder.CreateStructGEP(ioTy, io, field);
+    }
+
+    Value *ioCall(FunctionType *type, unsigned field)
+    {
+        Value *callee = builder.CreateLoad(type->getPointerTo(), ioField(field));
+        CallInst *call = builder.CreateCall(type, callee, {io});
+        call->addFnAttr(Attribute::NoUnwind);
+        return call;
+    }
+
+    // out[out_pos++] = val, flushing first when the buffer is full
+    void emitOutput(Value *val)
+    {
+        BasicBlock *cur = builder.GetInsertBlock();
+        BasicBlock *flush = BasicBlock::Create(ctx, "out.flush", func);
+        BasicBlock *store = BasicBlock::Create(ctx, "out.store", func);
+
+        Value *pos = builder.CreateLoad(i32, ioField(IO_OUT_POS));
+        Value *cap = builder.CreateLoad(i32, ioField(IO_OUT_CAP));
+        builder.CreateCondBr(builder.CreateICmpUGE(pos, cap), flush, store, unlikely());
+
+        builder.SetInsertPoint(flush);
+        ioCall(flushTy, IO_FLUSH);
+        builder.CreateBr(store);
+
+        builder.SetInsertPoint(store);
+        PHINode *at = builder.CreatePHI(i32, 2, "out.pos");
+        at->addIncoming(pos, cur);
+        at->addIncoming(builder.getInt32(0), flush);
+        Value *out = builder.CreateLoad(i8->getPointerTo(), ioField(IO_OUT));
+        builder.CreateStore(val, builder.CreateInBoundsGEP(i8, out, at));
+        builder.CreateStore(builder.CreateAdd(at, builder.getInt32(1)), ioField(IO_OUT_POS));
+
+        if (flushLines)
+        {
+            BasicBlock *line = BasicBlock::Create(ctx, "out.line", func);
+            BasicBlock *next = BasicBlock::Create(ctx, "out.next", func);
+            builder.CreateCondBr(builder.CreateICmpEQ(val, builder.getInt8('\n')), line, next);
+            builder.SetInsertPoint(line);
+            ioCall(flushTy, IO_FLUSH);
+            builder.CreateBr(next);
+            builder.SetInsertPoint(next);
+        }
+    }
+
+    // in[in_pos++], refilling when the buffer is drained
+    Value *emitInput()
+    {
+        BasicBlock *read = BasicBlock::Create(ctx, "in.read", func);
+        BasicBlock *fill = BasicBlock::Create(ctx, "in.fill", func);
+        BasicBlock *done = BasicBlock::Create(ctx, "in.done", func);
+
+        Value *pos = builder.CreateLoad(i32, ioField(IO_IN_POS));
+        Value *len = builder.CreateLoad(i32, ioField(IO_IN_LEN));
+        builder.CreateCondBr(builder.CreateICmpULT(pos, len), read, fill);
+
+        builder.SetInsertPoint(read);
+        Value *in = builder.CreateLoad(i8->getPointerTo(), ioField(IO_IN));
+        Value *buffered = builder.CreateLoad(i8, builder.CreateInBoundsGEP(i8, in, pos));
+        builder.CreateStore(builder.CreateAdd(pos, builder.getInt32(1)), ioField(IO_IN_POS));
+        builder.CreateBr(done);
+
+        builder.SetInsertPoint(fill);
+        Value *filled = ioCall(fillTy, IO_FILL);
+        builder.CreateBr(done);
+
+        builder.SetInsertPoint(done);
+        PHINode *val = builder.CreatePHI(i8, 2, "in.val");
+        val->addIncoming(buffered, read);
+        val->addIncoming(filled, fill);
+        return val;
+    }
+
+    MDNode *unlikely()
+    {
+        return MDBuilder(ctx).createBranchWeights(1, 1 << 20);
+    }
+
+    Value *cell(Value *base, int32_t offset)
+    {
+        Value *idx = base;
+        if (offset != 0)
+        {
+            idx = builder.CreateAnd(builder.CreateAdd(base, builder.getInt32(offset)), mask);
+        }
+        return builder.CreateInBoundsGEP(i8, memory, idx, "cell");
+    }
+
+    void emit(const bf_insn &insn)
+    {
+        switch (insn.opcode)
+        {
+            case BF_INSN_AA:
+                addr = builder.CreateAnd(builder.CreateAdd(addr, builder.getInt32(insn.operand)), mask, "addr");
+                break;
+            case BF_INSN_VA:
+            {
+                Value *ptr = cell(addr, insn.offset);
+                Value *val = builder.CreateLoad(i8, ptr);
+                builder.CreateStore(builder.CreateAdd(val, builder.getInt8(insn.operand)), ptr);
+                break;
+            }
+            case BF_INSN_SET:
+                builder.CreateStore(builder.getInt8(insn.operand), cell(addr, insn.offset));
+                break;
+            case BF_INSN_MUL:
+            {
+                Value *val = builder.CreateLoad(i8, cell(addr, insn.offset));
+                Value *prod = builder.CreateMul(val, builder.getInt8(insn.operand));
+                Value *ptr = cell(addr, insn.target);
+                builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i8, ptr), prod), ptr);
+                break;
+            }
+            case BF_INSN_VI:
+            {
+                Value *val = emitInput();
+                builder.CreateStore(val, cell(addr, insn.offset));
+                break;
+            }
+            case BF_INSN_VO:
+            {
+                Value *val = builder.CreateLoad(i8, cell(addr, insn.offset));
+                emitOutput(val);
+                break;
+            }
+            case BF_INSN_SCAN:
+            {
+                CallInst *call = builder.CreateCall(scanTy, scan, {memory, addr, builder.getInt32(insn.operand), builder.getInt32(mask)});
+                call->addFnAttr(Attribute::NoUnwind);
+                addr = call;
+                break;
+            }
+            case BF_INSN_LB:
+            {
+                BfLlvmIrLoop loop;
+                loop.index = numLoops++;
+                BasicBlock *preheader = BasicBlock::Create(ctx, "preheader", func);
+                loop.header = BasicBlock::Create(ctx, "loop", func);
+                BasicBlock *body = BasicBlock::Create(ctx, "body", func);
+                loop.exit = BasicBlock::Create(ctx, "exit", func);
+
+                builder.CreateBr(preheader);
+                builder.SetInsertPoint(preheader);
+                builder.CreateBr(loop.header);
+
+                builder.SetInsertPoint(loop.header);
+                loop.addr = builder.CreatePHI(i32, 2, "addr");
+                loop.addr->addIncoming(addr, preheader);
+                addr = loop.addr;
+                Value *val = builder.CreateLoad(i8, cell(addr, 0));
+                builder.CreateCondBr(builder.CreateICmpEQ(val, builder.getInt8(0)), loop.exit, body,
+                                     pgoCounts ? loopWeights(loop.index) : nullptr);
+
+                builder.SetInsertPoint(body);
+                if (pgoCounters)
+                {
+                    countEvent(2 * loop.index);
+                }
+                loops.push_back(loop);
+                break;
+            }
+            case BF_INSN_LE:
+            {
+                // the latch goes back to the header, which re-checks the cell
+                BfLlvmIrLoop &loop = loops.back();
+                loop.addr->addIncoming(addr, builder.GetInsertBlock());
+                BranchInst *latch = builder.CreateBr(loop.header);
+                latch->setMetadata(LLVMContext::MD_loop, loopId());
+
+                builder.SetInsertPoint(loop.exit);
+                if (pgoCounters)
+                {
+                    countEvent(2 * loop.index + 1);
+                }
+                addr = loop.addr;
+                loops.pop_back();
+                break;
+            }
+            default:
+                fprintf(stderr, "Error: Invalid instruction %d\n", insn.opcode);
+                exit(1);
+        }
+    }
 
-static void bf_llvm_ir_emit_vi(std::ostream &os, unsigned int ninst)
+    // i32 name(io, memory, scan, addr) defined in another module
+    Function *declareLoop(Module &module, const std::string &name)
+    {
+        FunctionType *loopTy = FunctionType::get(i32, {io->getType(), memory->getType(), scan->getType(), i32}, false);
+        Function *loop = Function::Create(loopTy, Function::ExternalLinkage, name, module);
+        loop->addFnAttr(Attribute::NoUnwind);
+        return loop;
+    }
+
+    // addr = callee(io, memory, scan, addr), callee made in loopFunction mode;
+    // the first header check stays here so that a loop which never runs is
+    // never called, and never compiled by a lazy JIT
+    void emitCall(Function *callee)
+    {
+        BasicBlock *cur = builder.GetInsertBlock();
+        BasicBlock *call = BasicBlock::Create(ctx, "call", func);
+        BasicBlock *next = BasicBlock::Create(ctx, "next", func);
+        Value *val = builder.CreateLoad(i8, cell(addr, 0));
+        builder.CreateCondBr(builder.CreateICmpEQ(val, builder.getInt8(0)), next, call);
+
+        builder.SetInsertPoint(call);
+        CallInst *result = builder.CreateCall(callee, {io, memory, scan, addr});
+        result->addFnAttr(Attribute::NoUnwind);
+        builder.CreateBr(next);
+
+        builder.SetInsertPoint(next);
+        PHINode *phi = builder.CreatePHI(i32, 2, "addr");
+        phi->addIncoming(addr, cur);
+        phi->addIncoming(result, call);
+        addr = phi;
+    }
+
+    // distinct self-referencing node identifying one loop
+    MDNode *loopId()
+    {
+        auto temp = MDNode::getTemporary(ctx, None);
+        MDNode *id = MDNode::getDistinct(ctx, {temp.get()});
+        id->replaceOperandWith(0, id);
+        return id;
+    }
+
+    void finish()
+    {
+        if (returnsAddr)
+        {
+            builder.CreateRet(addr);
+        }
+        else
+        {
+            builder.CreateRetVoid();
+        }
+    }
+
+    LLVMContext &ctx;
+    IRBuilder<> builder;
+    Type *i8;
+    Type *i32;
+    StructType *ioTy;
+    FunctionType *flushTy;
+    FunctionType *fillTy;
+    bool flushLines;
+    const std::vector<uint64_t> *pgoCounts;
+    GlobalVariable *pgoCounters {nullptr};
+    bool returnsAddr;
+    uint32_t mask;
+    unsigned numLoops {0};
+    FunctionType *scanTy;
+    Function *func;
+    Value *io;
+    Value *memory;
+    Value *scan;
+    Value *addr;
+
+    struct BfLlvmIrLoop
+    {
+        BasicBlock *header;
+        BasicBlock *exit;
+        PHINode *addr;
+        unsigned index;
+    };
+    std::vector<BfLlvmIrLoop> loops;
+};
+
+void bfLlvmInitialize()
 {
-    os << "inst" << ninst << ":\n";
-    os << "  ; VI\n";
-    os << "  %inst" << ninst << "_addr = load i32, i32* %addr\n";
-    os << "  %inst" << ninst << "_mem = getelementptr i8, i8* %memory, i32 %inst" << ninst << "_addr\n";
-    os << "  %inst" << ninst << "_val = call i8 %readbyte(i8* %ctx)\n";
-    os << "  store i8 %inst" << ninst << "_val, i8* %inst" << ninst << "_mem\n";
-    os << "  br label %inst" << (ninst + 1) << "\n";
+    // using atomic operations to ensure thread safety
+    static std::atomic<bool> initialized(false);
+    if (!initialized.exchange(true))
+    {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    }
 }
 
-static void bf_llvm_ir_emit_vo(std::ostream &os, unsigned int ninst)
+// LLVM 14 cannot list the features of a target and only warns about an
+// unknown name when it looks one up. Toggling a known feature always
+// changes the feature bits, so probe that with the warning silenced.
+static bool isKnownFeature(MCSubtargetInfo &sti, const std::string &name)
 {
-    os << "inst" << ninst << ":\n";
-    os << "  ; VO\n";
-    os << "  %inst" << ninst << "_addr = load i32, i32* %addr\n";
-    os << "  %inst" << ninst << "_mem = getelementptr i8, i8* %memory, i32 %inst" << ninst << "_addr\n";
-    os << "  %inst" << ninst << "_val = load i8, i8* %inst" << ninst << "_mem\n";
-    os << "  call void %writebyte(i8* %ctx, i8 %inst" << ninst << "_val)\n";
-    os << "  br label %inst" << (ninst + 1) << "\n";
+    FeatureBitset bits = sti.getFeatureBits();
+    errs().flush();
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (saved >= 0 && null >= 0)
+    {
+        dup2(null, STDERR_FILENO);
+    }
+    bool known = sti.ToggleFeature("+" + name) != bits;
+    errs().flush();
+    if (saved >= 0 && null >= 0)
+    {
+        dup2(saved, STDERR_FILENO);
+    }
+    if (saved >= 0)
+    {
+        close(saved);
+    }
+    if (null >= 0)
+    {
+        close(null);
+    }
+    sti.setFeatureBits(bits);
+    return known;
 }
 
-static void bf_llvm_ir_emit_inst(std::ostream &os, unsigned int ninst, const bf_insn &insn)
+BfLlvmTarget bfLlvmTarget(const std::string &march, const std::string &mattr)
 {
-    switch (insn.opcode)
-    {
-        case BF_INSN_AA:
-            bf_llvm_ir_emit_aa(os, ninst, insn.operand);
-            break;
-        case BF_INSN_VA:
-            bf_llvm_ir_emit_va(os, ninst, insn.operand);
-            break;
-        case BF_INSN_LB:
-            bf_llvm_ir_emit_lb(os, ninst, insn.operand);
-            break;
-        case BF_INSN_LE:
-            bf_llvm_ir_emit_le(os, ninst, insn.operand);
-            break;
-        case BF_INSN_VI:
-            bf_llvm_ir_emit_vi(os, ninst);
-            break;
-        case BF_INSN_VO:
-            bf_llvm_ir_emit_vo(os, ninst);
-            break;
-        default:
-            fprintf(stderr, "Error: Invalid instruction %d\n", insn.opcode);
+    // LLVM only warns about an unknown CPU or feature and then may not even
+    // support the triple, so reject them here
+    bfLlvmInitialize();
+    std::string triple = sys::getDefaultTargetTriple();
+    std::string error;
+    const Target *t = TargetRegistry::lookupTarget(triple, error);
+    std::unique_ptr<MCSubtargetInfo> sti(t ? t->createMCSubtargetInfo(triple, "", "") : nullptr);
+    if (!sti)
+    {
+        fprintf(stderr, "Error: Cannot get the features of %s\n", triple.c_str());
+        exit(1);
+    }
+
+    BfLlvmTarget target;
+    SubtargetFeatures features;
+    target.cpu = march;
+    if (march != "native")
+    {
+        if (!sti->isCPUStringValid(march))
+        {
+            fprintf(stderr, "Error: Unknown CPU %s for %s\n", march.c_str(), triple.c_str());
             exit(1);
+        }
+    }
+    else
+    {
+        target.cpu = sys::getHostCPUName().str();
+        StringMap<bool> hostFeatures;
+        if (sys::getHostCPUFeatures(hostFeatures))
+        {
+            for (const auto &feature : hostFeatures)
+            {
+                features.AddFeature(feature.first(), feature.second);
+            }
+        }
     }
-}
 
-static void bf_llvm_ir_emit_header(std::ostream &os, size_t inst_count)
-{
-    os << "define void @bfcode(i8* %ctx, i8* %memory, i8 (i8*)* %readbyte, void (i8*, i8)* %writebyte)\n";
-    os << "{\n";
-    os << "entry:\n";
-    os << "  %addr = alloca i32\n";
-    os << "  store i32 0, i32* %addr\n";
-    os << "  br label %inst0\n";
+    SmallVector<StringRef, 8> attrs;
+    StringRef(mattr).split(attrs, ',', -1, false);
+    for (StringRef attr : attrs)
+    {
+        attr = attr.trim();
+        std::string name = SubtargetFeatures::StripFlag(attr).lower();
+        if (name.empty() || !isKnownFeature(*sti, name))
+        {
+            fprintf(stderr, "Error: Unknown feature %s for %s\n", attr.str().c_str(), triple.c_str());
+            exit(1);
+        }
+        // AddFeature keeps an explicit sign
+        features.AddFeature(attr);
+    }
+    target.features = features.getString();
+    return target;
 }
 
-static void bf_llvm_ir_emit_footer(std::ostream &os, size_t inst_count)
+void bfLlvmIrOptimize(Module &module, TargetMachine *tm, int level)
 {
-    os << "inst" << inst_count << ":\n";
-    os << "  ; end\n";
-    os << "  ret void\n";
-    os << "}\n";
+    static const OptimizationLevel levels[] =
+    {
+        OptimizationLevel::O0,
+        OptimizationLevel::O1,
+        OptimizationLevel::O2,
+        OptimizationLevel::O3,
+    };
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(tm);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(levels[level]);
+    MPM.run(module, MAM);
 }
 
-void bfLlvmIrDumpToFile(const std::string &bf_file, const std::string &llvm_ir)
+void bfLlvmIrDumpToFile(const std::string &bf_file, const Module &module)
 {
     std::string ir_file = bf_file + ".ll";
-    FILE *fp = fopen(ir_file.c_str(), "w");
-    if (!fp)
+    std::error_code ec;
+    raw_fd_ostream os(ir_file, ec, sys::fs::OF_Text);
+    if (ec)
     {
         fprintf(stderr, "Error: Cannot open file %s\n", ir_file.c_str());
         return;
     }
 
-    fprintf(fp, "%s", llvm_ir.c_str());
-    fclose(fp);
+    module.print(os, nullptr);
+}
+
+std::unique_ptr<Module> bfLlvmIrGenerate(const bf_insn *insns, size_t count, LLVMContext &context,
+                                         const BfLlvmIrOptions &options)
+{
+    unsigned numLoops = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        numLoops += insns[i].opcode == BF_INSN_LB;
+    }
+    if (options.pgoCounters && options.pgoCounters->size() != 2 * numLoops)
+    {
+        fprintf(stderr, "Error: Profile has %zu counters, expected %u\n", options.pgoCounters->size(), 2 * numLoops);
+        exit(1);
+    }
+
+    auto module = std::make_unique<Module>("bfcode", context);
+    BfLlvmIrGen gen(context, *module, options, numLoops);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (options.outlineLoops && insns[i].opcode == BF_INSN_LB)
+        {
+            size_t le = insns[i].operand;
+            std::string name = "bfloop_" + std::to_string(i);
+            if (options.declareLoops)
+            {
+                gen.emitCall(gen.declareLoop(*module, name));
+            }
+            else
+            {
+                BfLlvmIrGen loop(context, *module, options, 0, name.c_str(), true);
+                for (size_t j = i; j <= le; j++)
+                {
+                    loop.emit(insns[j]);
+                }
+                loop.finish();
+                gen.emitCall(loop.func);
+            }
+            i = le;
+            continue;
+        }
+        gen.emit(insns[i]);
+    }
+    gen.finish();
+    return module;
 }
 
-std::string bfLlvmIrGenerate(const std::vector<bf_insn> &insns)
+std::unique_ptr<Module> bfLlvmIrGenerateLoop(const bf_insn *insns, size_t lb, LLVMContext &context,
+                                             const BfLlvmIrOptions &options, const std::string &name)
 {
-    std::ostringstream os;
-    bf_llvm_ir_emit_header(os, insns.size());
-    for (unsigned int i = 0; i < insns.size(); i++)
+    auto module = std::make_unique<Module>(name, context);
+    BfLlvmIrGen gen(context, *module, options, 0, name.c_str(), true);
+    for (size_t i = lb; i <= (size_t)insns[lb].operand; i++)
     {
-        bf_llvm_ir_emit_inst(os, i, insns[i]);
+        gen.emit(insns[i]);
     }
-    bf_llvm_ir_emit_footer(os, insns.size());
-    return os.str();
+    gen.finish();
+    return module;
 }
@@ -1,11 +1,56 @@
 #ifndef __bf_llvm_ir_h__
 #define __bf_llvm_ir_h__
 
+#include <memory>
 #include <string>
 #include <vector>
 #include "bf_runner_bf_insn.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
 
-void bfLlvmIrDumpToFile(const std::string &bf_file, const std::string &llvm_ir);
-std::string bfLlvmIrGenerate(const std::vector<bf_insn> &insns);
+// register the native target with LLVM, safe to call more than once
+void bfLlvmInitialize();
+
+struct BfLlvmTarget
+{
+    std::string cpu;
+    std::string features;
+};
+
+// --march and --mattr: "native" is the host CPU with all of its features,
+// any other CPU gets its default features; mattr ("+avx2,-avx512f") is
+// appended, a feature without a sign is enabled
+BfLlvmTarget bfLlvmTarget(const std::string &march, const std::string &mattr);
+
+struct BfLlvmIrOptions
+{
+    // call io->flush after every '\n'
+    bool lineFlush {false};
+    // power of two, memory is dereferenceable for that many bytes
+    uint32_t tapeSize {BF_TAPE_DEFAULT_SIZE};
+    // count loop iterations and exits into @bf_pgo_counters, see bf_pgo.h
+    bool pgoInstrument {false};
+    // counters of a previous instrumented run, become loop branch weights
+    const std::vector<uint64_t> *pgoCounters {nullptr};
+    // move each top-level loop into its own function, bfloop_<lb>, so that
+    // a lazy JIT compiles it on first call; not combined with PGO
+    bool outlineLoops {false};
+    // with outlineLoops, only declare the loop functions; each one is then
+    // generated into a module of its own with bfLlvmIrGenerateLoop
+    bool declareLoops {false};
+};
+
+void bfLlvmIrDumpToFile(const std::string &bf_file, const llvm::Module &module);
+std::unique_ptr<llvm::Module> bfLlvmIrGenerate(const bf_insn *insns, size_t count, llvm::LLVMContext &context,
+                                               const BfLlvmIrOptions &options);
+// Just the loop starting at insns[lb], as a function taking and returning
+// addr. pgoInstrument and pgoCounters are not supported here.
+std::unique_ptr<llvm::Module> bfLlvmIrGenerateLoop(const bf_insn *insns, size_t lb, llvm::LLVMContext &context,
+                                                   const BfLlvmIrOptions &options, const std::string &name);
+
+
+// run the default PassBuilder pipeline for -O<level>, 1 to 3
+void bfLlvmIrOptimize(llvm::Module &module, llvm::TargetMachine *tm, int level);
 
 #endif
@@ -0,0 +1,29 @@
+#ifndef __bf_pgo_h__
+#define __bf_pgo_h__
+
+#include <stdint.h>
+
+/*
+ * Loop profile written by --pgo-instrument executables at exit and read
+ * back by --pgo-use. Two counters per loop, in '[' order: iterations
+ * (entries into the body) and exits. Runs with the same program are
+ * summed into the existing file.
+ *
+ *   bf_pgo_header
+ *   uint64_t counters[count]
+ */
+#define BF_PGO_MAGIC "BFPG"
+#define BF_PGO_VERSION 1
+#define BF_PGO_DEFAULT_PATH "bf.profile"
+#define BF_PGO_PATH_ENV "BF_PGO_PROFILE"
+
+struct bf_pgo_header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;   // bf_bytecode_checksum() of the instrumented program
+    uint32_t count;  // counters, 2 per loop
+    uint32_t reserved;
+};
+
+#endif
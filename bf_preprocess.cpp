@@ -0,0 +1,222 @@
+#include "bf_preprocess.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BF_PREPROCESS_X86 1
+#endif
+
+static bool isCommand(unsigned char c)
+{
+    switch (c)
+    {
+        case '+': case ',': case '-': case '.':
+        case '<': case '>': case '[': case ']':
+            return true;
+        default:
+            return false;
+    }
+}
+
+static size_t filterScalar(const char *src, size_t len, char *dst)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = src[i];
+        // unconditional store keeps the loop branch free
+        dst[n] = c;
+        n += isCommand((unsigned char)c);
+    }
+    return n;
+}
+
+static size_t scanScalar(const char *src, size_t len)
+{
+    size_t i = 0;
+    while (i < len && isCommand((unsigned char)src[i]))
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef BF_PREPROCESS_X86
+
+// '+' ',' '-' '.' are 0x2b..0x2e, '<' '>' only differ in bit 1,
+// '[' and ']' need their own compare
+static inline __m128i classifySse2(__m128i v)
+{
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(0x2b));
+    __m128i arith = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(3)), d);
+    __m128i move = _mm_cmpeq_epi8(_mm_or_si128(v, _mm_set1_epi8(2)), _mm_set1_epi8(0x3e));
+    __m128i lb = _mm_cmpeq_epi8(v, _mm_set1_epi8('['));
+    __m128i le = _mm_cmpeq_epi8(v, _mm_set1_epi8(']'));
+    return _mm_or_si128(_mm_or_si128(arith, move), _mm_or_si128(lb, le));
+}
+
+static size_t filterSse2(const char *src, size_t len, char *dst)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(classifySse2(v));
+        if (mask == 0xffff)
+        {
+            _mm_storeu_si128((__m128i *)(dst + n), v);
+            n += 16;
+            continue;
+        }
+        while (mask)
+        {
+            dst[n++] = src[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+    }
+    return n + filterScalar(src + i, len - i, dst + n);
+}
+
+static size_t scanSse2(const char *src, size_t len)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(classifySse2(v));
+        if (mask != 0xffff)
+        {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i + scanScalar(src + i, len - i);
+}
+
+// shuffle control that packs the selected bytes of an 8-byte group to the front
+static uint64_t sCompactTable[256];
+
+static void initCompactTable()
+{
+    for (unsigned int mask = 0; mask < 256; mask++)
+    {
+        uint64_t ctrl = 0;
+        unsigned int k = 0;
+        for (unsigned int bit = 0; bit < 8; bit++)
+        {
+            if (mask & (1u << bit))
+            {
+                ctrl |= (uint64_t)bit << (8 * k++);
+            }
+        }
+        sCompactTable[mask] = ctrl;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t classifyAvx2(__m256i v)
+{
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8(0x2b));
+    __m256i arith = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(3)), d);
+    __m256i move = _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(2)), _mm256_set1_epi8(0x3e));
+    __m256i brackets = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')),
+                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(arith, move), brackets));
+}
+
+__attribute__((target("avx2")))
+static size_t filterAvx2(const char *src, size_t len, char *dst)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        uint32_t mask = classifyAvx2(v);
+
+        if (mask == 0xffffffffu)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + n), v);
+            n += 32;
+            continue;
+        }
+        if (mask == 0)
+        {
+            continue;
+        }
+
+        for (int lane = 0; lane < 2; lane++)
+        {
+            __m128i bytes = lane ? _mm256_extracti128_si256(v, 1) : _mm256_castsi256_si128(v);
+            unsigned int lo = (mask >> (16 * lane)) & 0xff;
+            unsigned int hi = (mask >> (16 * lane + 8)) & 0xff;
+            __m128i ctrl = _mm_set_epi64x((long long)(sCompactTable[hi] + 0x0808080808080808ull),
+                                          (long long)sCompactTable[lo]);
+            __m128i packed = _mm_shuffle_epi8(bytes, ctrl);
+            _mm_storel_epi64((__m128i *)(dst + n), packed);
+            n += __builtin_popcount(lo);
+            _mm_storel_epi64((__m128i *)(dst + n), _mm_unpackhi_epi64(packed, packed));
+            n += __builtin_popcount(hi);
+        }
+    }
+    return n + filterSse2(src + i, len - i, dst + n);
+}
+
+__attribute__((target("avx2")))
+static size_t scanAvx2(const char *src, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        uint32_t mask = classifyAvx2(_mm256_loadu_si256((const __m256i *)(src + i)));
+        if (mask != 0xffffffffu)
+        {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i + scanSse2(src + i, len - i);
+}
+
+#endif
+
+struct BfPreprocessKernels
+{
+    size_t (*filter)(const char *, size_t, char *);
+    size_t (*scan)(const char *, size_t);
+};
+
+static BfPreprocessKernels selectKernels()
+{
+#ifdef BF_PREPROCESS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        initCompactTable();
+        return {filterAvx2, scanAvx2};
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return {filterSse2, scanSse2};
+    }
+#endif
+    return {filterScalar, scanScalar};
+}
+
+static const BfPreprocessKernels &kernels()
+{
+    static const BfPreprocessKernels k = selectKernels();
+    return k;
+}
+
+size_t bf_preprocess_filter(const char *src, size_t len, char *dst)
+{
+    return kernels().filter(src, len, dst);
+}
+
+size_t bf_preprocess_scan(const char *src, size_t len)
+{
+    return kernels().scan(src, len);
+}
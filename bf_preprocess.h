@@ -0,0 +1,13 @@
+#ifndef __bf_preprocess_h__
+#define __bf_preprocess_h__
+
+#include <stddef.h>
+
+// Copy only the 8 command bytes of src into dst and return how many were
+// kept. dst needs room for len bytes and may alias src.
+size_t bf_preprocess_filter(const char *src, size_t len, char *dst);
+
+// Return the offset of the first byte that is not a command, or len.
+size_t bf_preprocess_scan(const char *src, size_t len);
+
+#endif
@@ -1,53 +1,129 @@
 #include "bf_runner.h"
+#include "bf_preprocess.h"
 
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-static std::string readCode(const std::string &filename)
+// filter granularity, source pages are released after each chunk
+#define BF_PREPROCESS_CHUNK (1 << 20)
+
+void BfRunner::preprocessCode()
 {
-    FILE *file = fopen(filename.c_str(), "rb");
-    if (!file)
-    {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
-    }
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    std::string code(fileSize, '\0');
-    size_t bytesRead = fread(&code[0], 1, fileSize, file);
-    if (bytesRead != fileSize)
+    // everything but the 8 commands is a comment
+    mTimer.start("preprocess");
+    const char *src = mSourceCode.data();
+    size_t len = mSourceCode.size();
+    size_t keep = bf_preprocess_scan(src, len);
+
+    // dense sources keep pointing at the mapped file
+    if (keep != len)
     {
-        perror("Error reading file");
-        fclose(file);
-        exit(EXIT_FAILURE);
+        char *code = (char *)malloc(len);
+        if (!code)
+        {
+            perror("Error allocating source buffer");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(code, src, keep);
+        for (size_t pos = keep; pos < len; pos += BF_PREPROCESS_CHUNK)
+        {
+            size_t n = std::min((size_t)BF_PREPROCESS_CHUNK, len - pos);
+            keep += bf_preprocess_filter(src + pos, n, code + keep);
+            mSourceCode.discard(pos + n);
+        }
+        mSourceCode.adopt(code, keep);
     }
-    fclose(file);
-    return code;
+    mTimer.stop();
 }
 
-void BfRunner::preprocessCode()
+BfRunner::BfRunner()
+    : mOutBuffer(BF_IO_BUF_SIZE), mInBuffer(BF_IO_BUF_SIZE)
+{
+    mIo.out = mOutBuffer.data();
+    mIo.out_cap = mOutBuffer.size();
+    mIo.in = mInBuffer.data();
+    mIo.user = this;
+    mIo.flush = ioFlush;
+    mIo.fill = ioFill;
+}
+
+void BfRunner::setOutputBufferSize(size_t size)
+{
+    flushOutput();
+    mOutBuffer.assign(std::max(size, (size_t)1), 0);
+    mIo.out = mOutBuffer.data();
+    mIo.out_cap = mOutBuffer.size();
+}
+
+void BfRunner::setInputBufferSize(size_t size)
 {
-    // TODO: remove comments and space
+    // anything already buffered is dropped, only call this before run()
+    mInBuffer.assign(std::max(size, (size_t)1), 0);
+    mIo.in = mInBuffer.data();
+    mIo.in_pos = mIo.in_len = 0;
 }
 
-void BfRunner::writeByte(BfRunner *runner, unsigned char byte)
+void BfRunner::ioFlush(bf_io *io)
 {
-    write(runner->mOutputFd, &byte, 1);    
+    BfRunner *runner = (BfRunner *)io->user;
+    const uint8_t *data = io->out;
+    uint32_t len = io->out_pos;
+    if (len > 0)
+    {
+        runner->mFlushCount++;
+    }
+    while (len > 0)
+    {
+        ssize_t n = write(runner->mOutputFd, data, len);
+        if (n <= 0)
+        {
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    io->out_pos = 0;
 }
 
-unsigned char BfRunner::readByte(BfRunner *runner)
+uint8_t BfRunner::ioFill(bf_io *io)
 {
-    unsigned char byte;
-    if (read(runner->mInputFd, &byte, 1) != 1)
+    BfRunner *runner = (BfRunner *)io->user;
+    if (runner->mFlushPolicy != BF_FLUSH_FULL)
+    {
+        ioFlush(io);
+    }
+    runner->mReadCount++;
+    ssize_t n = read(runner->mInputFd, runner->mInBuffer.data(), runner->mInBuffer.size());
+    if (n <= 0)
     {
         // EOF?
+        io->in_pos = io->in_len = 0;
         return 0;
     }
-    return byte;
+    io->in_pos = 1;
+    io->in_len = n;
+    return io->in[0];
+}
+
+void BfRunner::flushOutput()
+{
+    ioFlush(&mIo);
+}
+
+void BfRunner::finishRun()
+{
+    mTimer.start("IO flush");
+    flushOutput();
+    mTimer.stop();
+    mTimer.note(std::to_string(mFlushCount) + " flushes, " + std::to_string(mReadCount) + " reads");
 }
 
 void BfRunner::setSourcePath(const std::string &path)
 {
     mSourcePath = path;
-    mSourceCode = readCode(path);
+    mTimer.start("load");
+    mSourceCode.load(path);
+    mTimer.stop();
 }
@@ -3,16 +3,25 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <unistd.h>
 #include "bf_elapsed_timer.h"
+#include "bf_io.h"
+#include "bf_source_buffer.h"
+#include "bf_tape.h"
 
-#define BF_MEM_SIZE (1 << 20)
-#define BF_ADDR_MASK (BF_MEM_SIZE - 1)
+// when buffered output is written out besides a full buffer and exit
+enum BfFlushPolicy
+{
+    BF_FLUSH_FULL,  // never early, for batch runs
+    BF_FLUSH_LINE,  // after every '\n' and before reading input
+    BF_FLUSH_READ,  // before reading input, so prompts show up
+};
 
 class BfRunner
 {
 public:
-    BfRunner() = default;
+    BfRunner();
     virtual ~BfRunner() = default;
     
     void setInputFd(int fd)
@@ -25,11 +34,66 @@ public:
         mOutputFd = fd;
     }
 
+    void setFlushPolicy(BfFlushPolicy policy)
+    {
+        mFlushPolicy = policy;
+    }
+
+    BfFlushPolicy getFlushPolicy() const
+    {
+        return mFlushPolicy;
+    }
+
+    // power of two, BF_TAPE_MIN_SIZE to BF_TAPE_MAX_SIZE
+    void setTapeSize(size_t size)
+    {
+        mTapeSize = size;
+    }
+
+    size_t getTapeSize() const
+    {
+        return mTapeSize;
+    }
+
+    // cell addresses wrap with this
+    uint32_t getTapeMask() const
+    {
+        return (uint32_t)(mTapeSize - 1);
+    }
+
+    void setTapeHugePages(bool enable)
+    {
+        mTapeHugePages = enable;
+    }
+
+    bool getTapeHugePages() const
+    {
+        return mTapeHugePages;
+    }
+
+    void setOutputBufferSize(size_t size);
+    void setInputBufferSize(size_t size);
+
+    // write out whatever is still buffered, also called at exit
+    void flushOutput();
+    // flush after run() and report the I/O counters
+    void finishRun();
+
     void setEnableIrEmit(bool enable)
     {
         mEnableIrEmit = enable;
     }
 
+    void setOptLevel(int level)
+    {
+        mOptLevel = level;
+    }
+
+    void setOptPasses(const std::string &passes)
+    {
+        mOptPasses = passes;
+    }
+
     void setSourcePath(const std::string &path);
 
     BfElapsedTimer &getElapsedTimer()
@@ -43,15 +107,55 @@ public:
 
 protected:
     BfElapsedTimer mTimer;
-    std::string mSourceCode;
+    BfSourceBuffer mSourceCode;
     std::string mSourcePath;
     bool mEnableIrEmit {false};
-    static void writeByte(BfRunner *runner, unsigned char byte);
-    static unsigned char readByte(BfRunner *runner);
+    int mOptLevel {3};
+    std::string mOptPasses;
+
+    static void writeByte(BfRunner *runner, unsigned char byte)
+    {
+        bf_io *io = &runner->mIo;
+        if (io->out_pos >= io->out_cap)
+        {
+            ioFlush(io);
+        }
+        io->out[io->out_pos++] = byte;
+        if (byte == '\n' && runner->mFlushPolicy == BF_FLUSH_LINE)
+        {
+            ioFlush(io);
+        }
+    }
+
+    static unsigned char readByte(BfRunner *runner)
+    {
+        bf_io *io = &runner->mIo;
+        if (io->in_pos < io->in_len)
+        {
+            return io->in[io->in_pos++];
+        }
+        return ioFill(io);
+    }
+
+    // the same buffers, for generated code
+    bf_io *getIo()
+    {
+        return &mIo;
+    }
 
 private:
     int mInputFd {STDIN_FILENO};
     int mOutputFd {STDOUT_FILENO};
+    BfFlushPolicy mFlushPolicy {BF_FLUSH_READ};
+    size_t mTapeSize {BF_TAPE_DEFAULT_SIZE};
+    bool mTapeHugePages {false};
+    bf_io mIo {};
+    uint64_t mFlushCount {0};
+    uint64_t mReadCount {0};
+    std::vector<uint8_t> mOutBuffer;
+    std::vector<uint8_t> mInBuffer;
+    static void ioFlush(bf_io *io);
+    static uint8_t ioFill(bf_io *io);
 };
 
 #endif
@@ -1,18 +1,23 @@
 #include "bf_runner_bf_insn.h"
+#include "bf_bytecode.h"
+#include "bf_insn_opt.h"
+#include "bf_scan.h"
 
 void bf_insn_append(std::vector<bf_insn> &insns, int32_t code, int32_t operand)
 {
-    insns.push_back({code, operand});
+    insns.push_back({code, operand, 0, 0});
 }
 
-std::vector<bf_insn> bf_insn_parse(const char *code)
+std::vector<bf_insn> bf_insn_parse(const char *code, size_t len)
 {
     std::vector<bf_insn> insns;
     std::vector<int32_t> le_positions;
+    const char *end = code + len;
     char c;
 
-    while ((c = *code))
+    while (code != end)
     {
+        c = *code;
         switch (c)
         {
             case '>':
@@ -106,10 +111,16 @@ std::vector<bf_insn> bf_insn_parse(const char *code)
             }
         }
     }
+
+    if (!le_positions.empty())
+    {
+        fprintf(stderr, "Error: Unmatched '[' in source code\n");
+        exit(1);
+    }
     return insns;
 }
 
-static void dumpBfInsnToFile(const std::string &bf_file, std::vector<bf_insn> &insns)
+static void dumpBfInsnToFile(const std::string &bf_file, const bf_insn *insns, size_t count)
 {
     const char *bfInsnName[BF_INSN_MAX] =
     {
@@ -119,6 +130,9 @@ static void dumpBfInsnToFile(const std::string &bf_file, std::vector<bf_insn> &i
         "VO",
         "LB",
         "LE",
+        "SET",
+        "MUL",
+        "SCAN",
     };
 
     std::string ir_file = bf_file + ".bfinsn";
@@ -129,19 +143,28 @@ static void dumpBfInsnToFile(const std::string &bf_file, std::vector<bf_insn> &i
         return;
     }
 
-    for (unsigned int i = 0; i < insns.size(); i++)
+    for (unsigned int i = 0; i < count; i++)
     {
         int32_t code = insns[i].opcode;
         int32_t operand = insns[i].operand;
         const char *name = bfInsnName[code];
+        int32_t offset = insns[i].offset;
         if (code == BF_INSN_VI || code == BF_INSN_VO)
         {
-            fprintf(fp, "[%05x] %s\n", i, name);
+            fprintf(fp, "[%05x] %s @%d\n", i, name, (int)offset);
         }
         else if (code == BF_INSN_LB || code == BF_INSN_LE)
         {
             fprintf(fp, "[%05x] %s %05x\n", i, name, (unsigned int)operand);
         }
+        else if (code == BF_INSN_MUL)
+        {
+            fprintf(fp, "[%05x] %s %d, %d @%d\n", i, name, (int)insns[i].target, (int)operand, (int)offset);
+        }
+        else if (code == BF_INSN_VA || code == BF_INSN_SET)
+        {
+            fprintf(fp, "[%05x] %s %d @%d\n", i, name, (int)operand, (int)offset);
+        }
         else
         {
             fprintf(fp, "[%05x] %s %d\n", i, name, (int)operand);
@@ -151,15 +174,61 @@ static void dumpBfInsnToFile(const std::string &bf_file, std::vector<bf_insn> &i
 }
 
 
+void BfRunnerBfInsn::preprocessCode()
+{
+    mBytecode = bf_bytecode_is(mSourceCode.data(), mSourceCode.size());
+    if (!mBytecode)
+    {
+        BfRunner::preprocessCode();
+    }
+}
+
 void BfRunnerBfInsn::compileCode()
 {
+    if (mBytecode)
+    {
+        // already parsed and optimized, run from the mapping
+        mTimer.start("LOAD bytecode");
+        mProgram = bf_bytecode_load(mSourceCode.data(), mSourceCode.size(), &mProgramSize);
+        mTimer.stop();
+        mTimer.note(std::to_string(mProgramSize) + " insns");
+        if (mEnableIrEmit)
+        {
+            dumpBfInsnToFile(mSourcePath, mProgram, mProgramSize);
+        }
+        return;
+    }
+
     mTimer.start("GEN bf-insn");
-    mInsns = bf_insn_parse(mSourceCode.c_str());
+    mInsns = bf_insn_parse(mSourceCode.data(), mSourceCode.size());
     mTimer.stop();
 
+    std::vector<const bf_insn_pass *> passes;
+    if (mOptPasses.empty())
+    {
+        passes = bf_insn_opt_pipeline(mOptLevel);
+    }
+    else if (!bf_insn_opt_parse_passes(mOptPasses, passes))
+    {
+        exit(1);
+    }
+
+    for (const bf_insn_pass *pass : passes)
+    {
+        size_t before = mInsns.size();
+        mTimer.start((std::string("OPT ") + pass->name).c_str());
+        pass->run(mInsns);
+        mTimer.stop();
+        mTimer.note(std::to_string(before) + " -> " + std::to_string(mInsns.size()) + " insns");
+    }
+
+    mProgram = mInsns.data();
+    mProgramSize = mInsns.size();
+
     if (mEnableIrEmit)
     {
-        dumpBfInsnToFile(mSourcePath, mInsns);
+        dumpBfInsnToFile(mSourcePath, mProgram, mProgramSize);
+        bf_bytecode_write(mSourcePath + ".bfc", mProgram, mProgramSize);
     }
 }
 
@@ -169,28 +238,30 @@ void BfRunnerBfInsn::run()
 
     unsigned int pc = 0;
     unsigned int addr = 0;
-    std::vector<uint8_t> memory(BF_MEM_SIZE, 0);
+    BfTape tape(getTapeSize(), getTapeHugePages());
+    uint8_t *memory = tape.data();
+    const uint32_t mask = getTapeMask();
 
-    while (pc < mInsns.size())
+    while (pc < mProgramSize)
     {
         // printf("pc: %u, addr: %u\n", pc, addr);
-        const bf_insn &insn = mInsns[pc];
+        const bf_insn &insn = mProgram[pc];
         switch (insn.opcode)
         {
             case BF_INSN_AA:
-                addr = (addr + insn.operand) & BF_ADDR_MASK;
+                addr = (addr + insn.operand) & mask;
                 break;
             case BF_INSN_VA:
-                memory[addr] += insn.operand;
+                memory[(addr + insn.offset) & mask] += insn.operand;
                 break;
             case BF_INSN_VI:
                 {
-                    memory[addr] = readByte(this);
+                    memory[(addr + insn.offset) & mask] = readByte(this);
                 }
                 break;
             case BF_INSN_VO:
                 {
-                    writeByte(this, memory[addr]);
+                    writeByte(this, memory[(addr + insn.offset) & mask]);
                 }
                 break;
             case BF_INSN_LB:
@@ -205,6 +276,15 @@ void BfRunnerBfInsn::run()
                     pc = insn.operand;
                 }
                 break;
+            case BF_INSN_SET:
+                memory[(addr + insn.offset) & mask] = insn.operand;
+                break;
+            case BF_INSN_MUL:
+                memory[(addr + insn.target) & mask] += memory[(addr + insn.offset) & mask] * insn.operand;
+                break;
+            case BF_INSN_SCAN:
+                addr = bf_scan(memory, addr, insn.operand, mask);
+                break;
             default:
                 fprintf(stderr, "Error: Invalid instruction %d\n", insn.opcode);
                 exit(1);
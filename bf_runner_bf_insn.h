@@ -13,12 +13,17 @@ enum
     BF_INSN_VO,
     BF_INSN_LB,
     BF_INSN_LE,
+    BF_INSN_SET,
+    BF_INSN_MUL,
+    BF_INSN_SCAN,
     BF_INSN_MAX,
 };
 struct bf_insn
 {
     int32_t opcode;
     int32_t operand;
+    int32_t offset; // cell accessed, relative to addr
+    int32_t target; // MUL: destination cell, relative to addr
 };
 
 class BfRunnerBfInsn : public BfRunner
@@ -27,10 +32,16 @@ public:
     BfRunnerBfInsn() = default;
     ~BfRunnerBfInsn() override = default;
 
+    // a .bfc file is recognized here and skips preprocessing
+    void preprocessCode() override;
     void compileCode() override;
     void run() override;
 protected:
     std::vector<bf_insn> mInsns;
+    // the optimized program, mInsns or the instructions of a mapped .bfc
+    const bf_insn *mProgram {nullptr};
+    size_t mProgramSize {0};
+    bool mBytecode {false};
 };
 
 
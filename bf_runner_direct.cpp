@@ -5,20 +5,58 @@ struct BfRunnerDirect::BfRunnerDirectContext
 {
     uint8_t *memoryBase;
     uint32_t memoryAddr;
-    uint32_t nestedCount;
+    uint32_t memoryMask;
+    const char *codeBase;
     const char *codePtr;
+    const char *codeEnd;
 };
 
+void BfRunnerDirect::compileCode()
+{
+    mTimer.start("GEN jump-table");
+    std::vector<uint32_t> stack;
+    mJumpTable.assign(mSourceCode.size(), 0);
+
+    for (uint32_t pos = 0; pos < mSourceCode.size(); pos++)
+    {
+        char c = mSourceCode[pos];
+        if (c == '[')
+        {
+            stack.push_back(pos);
+        }
+        else if (c == ']')
+        {
+            if (stack.empty())
+            {
+                fprintf(stderr, "Error: Unmatched ']' in source code\n");
+                exit(1);
+            }
+            uint32_t lb_pos = stack.back();
+            stack.pop_back();
+            // both brackets land on their partner, run() then steps past it
+            mJumpTable[lb_pos] = pos;
+            mJumpTable[pos] = lb_pos;
+        }
+    }
+
+    if (!stack.empty())
+    {
+        fprintf(stderr, "Error: Unmatched '[' in source code\n");
+        exit(1);
+    }
+    mTimer.stop();
+}
+
 void BfRunnerDirect::step(BfRunnerDirectContext *brdc)
 {
     char inst = *brdc->codePtr;
     switch (inst)
     {
     case '>':
-        brdc->memoryAddr = (brdc->memoryAddr + 1) & BF_ADDR_MASK;
+        brdc->memoryAddr = (brdc->memoryAddr + 1) & brdc->memoryMask;
         break;
     case '<':
-        brdc->memoryAddr = (brdc->memoryAddr - 1) & BF_ADDR_MASK;
+        brdc->memoryAddr = (brdc->memoryAddr - 1) & brdc->memoryMask;
         break;
     case '+':
         brdc->memoryBase[brdc->memoryAddr]++;
@@ -35,54 +73,13 @@ void BfRunnerDirect::step(BfRunnerDirectContext *brdc)
     case '[':
         if (brdc->memoryBase[brdc->memoryAddr] == 0)
         {
-            int bracket_count = 1;
-            while (bracket_count > 0 && *++brdc->codePtr != '\0')
-            {
-                if (*brdc->codePtr == '[')
-                {
-                    bracket_count++;
-                }
-                else if (*brdc->codePtr == ']')
-                {
-                    bracket_count--;
-                }
-            }
-            if (bracket_count > 0)
-            {
-                fprintf(stderr, "Error: Unmatched '[' in source code\n");
-                exit(1);
-            }
-        }
-        else
-        {
-            brdc->nestedCount++;
+            brdc->codePtr = brdc->codeBase + mJumpTable[brdc->codePtr - brdc->codeBase];
         }
         break;
     case ']':
-        if (brdc->nestedCount == 0)
-        {
-            fprintf(stderr, "Error: Unmatched ']' in source code\n");
-            exit(1);
-        }
         if (brdc->memoryBase[brdc->memoryAddr] != 0)
         {
-            int bracket_count = 1;
-            while (bracket_count > 0)
-            {
-                brdc->codePtr--;
-                if (*brdc->codePtr == '[')
-                {
-                    bracket_count--;
-                }
-                else if (*brdc->codePtr == ']')
-                {
-                    bracket_count++;
-                }
-            }
-        }
-        else
-        {
-            brdc->nestedCount--;
+            brdc->codePtr = brdc->codeBase + mJumpTable[brdc->codePtr - brdc->codeBase];
         }
         break;
     case '\0':
@@ -109,14 +106,17 @@ void BfRunnerDirect::step(BfRunnerDirectContext *brdc)
 
 void BfRunnerDirect::run()
 {
-    std::vector<uint8_t> memoryBase(BF_MEM_SIZE, 0);
+    BfTape tape(getTapeSize(), getTapeHugePages());
 
     BfRunnerDirectContext brdc = {0};
-    brdc.memoryBase = memoryBase.data();
-    brdc.codePtr = mSourceCode.c_str();
+    brdc.memoryBase = tape.data();
+    brdc.memoryMask = getTapeMask();
+    brdc.codeBase = mSourceCode.data();
+    brdc.codePtr = brdc.codeBase;
+    brdc.codeEnd = brdc.codeBase + mSourceCode.size();
 
     mTimer.start("interpret");
-    while (*brdc.codePtr != '\0')
+    while (brdc.codePtr != brdc.codeEnd)
     {
         step(&brdc);
         brdc.codePtr++;
@@ -2,6 +2,8 @@
 #define __BF_RUNNER_DIRECT_H__
 
 #include "bf_runner.h"
+#include <vector>
+#include <stdint.h>
 
 class BfRunnerDirect : public BfRunner
 {
@@ -9,11 +11,13 @@ public:
     BfRunnerDirect() = default;
     ~BfRunnerDirect() override = default;
 
-    void compileCode() override {}
+    void compileCode() override;
     struct BfRunnerDirectContext;
     void run() override;
 private:
     void step(BfRunnerDirectContext *brdc);
+    // source offset of the matching bracket, only valid at '[' and ']'
+    std::vector<uint32_t> mJumpTable;
 };
 
 #endif // __BF_RUNNER_DIRECT_H__
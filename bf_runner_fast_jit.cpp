@@ -0,0 +1,303 @@
+#include "bf_runner_fast_jit.h"
+#include "bf_scan.h"
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Register usage of the generated code, void code(BfRunner *runner, uint8_t *memory):
+ *   rbx  memory base
+ *   r12d addr, always masked with the tape mask
+ *   r13  runner, first argument of readByte/writeByte
+ *   eax/ecx/edx scratch cell index and values
+ * Five pushes in the prologue keep rsp 16-byte aligned at every call.
+ */
+
+#if defined(__x86_64__)
+
+// Templates are copied verbatim, zero bytes at the listed offsets are holes
+// patched with the instruction operands.
+
+static const uint8_t kPrologue[] =
+{
+    0x55,                   // push rbp
+    0x53,                   // push rbx
+    0x41, 0x54,             // push r12
+    0x41, 0x55,             // push r13
+    0x41, 0x56,             // push r14
+    0x48, 0x89, 0xf3,       // mov rbx, rsi
+    0x49, 0x89, 0xfd,       // mov r13, rdi
+    0x45, 0x31, 0xe4,       // xor r12d, r12d
+};
+
+static const uint8_t kEpilogue[] =
+{
+    0x41, 0x5e,             // pop r14
+    0x41, 0x5d,             // pop r13
+    0x41, 0x5c,             // pop r12
+    0x5b,                   // pop rbx
+    0x5d,                   // pop rbp
+    0xc3,                   // ret
+};
+
+// eax = addr
+static const uint8_t kCellAddr[] =
+{
+    0x44, 0x89, 0xe0,       // mov eax, r12d
+};
+
+// eax = (addr + offset) & mask
+static const uint8_t kCellOffset[] =
+{
+    0x41, 0x8d, 0x84, 0x24, 0, 0, 0, 0,     // lea eax, [r12 + offset]
+    0x25, 0, 0, 0, 0,                       // and eax, mask
+};
+static const size_t kCellOffsetDisp = 4;
+static const size_t kCellOffsetMask = 9;
+
+static const uint8_t kAa[] =
+{
+    0x45, 0x8d, 0xa4, 0x24, 0, 0, 0, 0,     // lea r12d, [r12 + operand]
+    0x41, 0x81, 0xe4, 0, 0, 0, 0,           // and r12d, mask
+};
+static const size_t kAaDisp = 4;
+static const size_t kAaMask = 11;
+
+static const uint8_t kVa[] =
+{
+    0x80, 0x04, 0x03, 0,    // add byte [rbx + rax], operand
+};
+static const size_t kVaImm = 3;
+
+static const uint8_t kSet[] =
+{
+    0xc6, 0x04, 0x03, 0,    // mov byte [rbx + rax], operand
+};
+static const size_t kSetImm = 3;
+
+// edx = cell * operand, then eax is pointed at the target cell
+static const uint8_t kMulLoad[] =
+{
+    0x0f, 0xb6, 0x14, 0x03,         // movzx edx, byte [rbx + rax]
+    0x69, 0xd2, 0, 0, 0, 0,         // imul edx, edx, operand
+};
+static const size_t kMulLoadImm = 6;
+
+static const uint8_t kMulStore[] =
+{
+    0x00, 0x14, 0x03,               // add byte [rbx + rax], dl
+};
+
+static const uint8_t kVo[] =
+{
+    0x0f, 0xb6, 0x34, 0x03,                 // movzx esi, byte [rbx + rax]
+    0x4c, 0x89, 0xef,                       // mov rdi, r13
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,     // mov rax, writeByte
+    0xff, 0xd0,                             // call rax
+};
+static const size_t kVoFunc = 9;
+
+// the call clobbers eax, so the cell index is computed afterwards in ecx
+static const uint8_t kVi[] =
+{
+    0x4c, 0x89, 0xef,                       // mov rdi, r13
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,     // mov rax, readByte
+    0xff, 0xd0,                             // call rax
+    0x41, 0x8d, 0x8c, 0x24, 0, 0, 0, 0,     // lea ecx, [r12 + offset]
+    0x81, 0xe1, 0, 0, 0, 0,                 // and ecx, mask
+    0x88, 0x04, 0x0b,                       // mov byte [rbx + rcx], al
+};
+static const size_t kViFunc = 5;
+static const size_t kViDisp = 19;
+static const size_t kViMask = 25;
+
+static const uint8_t kScan[] =
+{
+    0x48, 0x89, 0xdf,                       // mov rdi, rbx
+    0x44, 0x89, 0xe6,                       // mov esi, r12d
+    0xba, 0, 0, 0, 0,                       // mov edx, stride
+    0xb9, 0, 0, 0, 0,                       // mov ecx, mask
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,     // mov rax, bf_scan
+    0xff, 0xd0,                             // call rax
+    0x41, 0x89, 0xc4,                       // mov r12d, eax
+};
+static const size_t kScanStride = 7;
+static const size_t kScanMask = 12;
+static const size_t kScanFunc = 18;
+
+// the rel32 of the jump is the last 4 bytes
+static const uint8_t kLb[] =
+{
+    0x42, 0x80, 0x3c, 0x23, 0x00,   // cmp byte [rbx + r12], 0
+    0x0f, 0x84, 0, 0, 0, 0,         // je after matching LE
+};
+
+static const uint8_t kLe[] =
+{
+    0x42, 0x80, 0x3c, 0x23, 0x00,   // cmp byte [rbx + r12], 0
+    0x0f, 0x85, 0, 0, 0, 0,         // jne after matching LB
+};
+
+struct BfFastJitEmitter
+{
+    std::vector<uint8_t> code;
+    uint32_t mask;
+
+    template <size_t N>
+    size_t emit(const uint8_t (&tpl)[N])
+    {
+        size_t pos = code.size();
+        code.insert(code.end(), tpl, tpl + N);
+        return pos;
+    }
+
+    void patch32(size_t pos, int32_t value)
+    {
+        memcpy(&code[pos], &value, sizeof(value));
+    }
+
+    void patch64(size_t pos, const void *value)
+    {
+        uint64_t v = (uint64_t)(uintptr_t)value;
+        memcpy(&code[pos], &v, sizeof(v));
+    }
+
+    // leave eax holding the index of the cell at addr + offset
+    void emitCell(int32_t offset)
+    {
+        if (offset == 0)
+        {
+            emit(kCellAddr);
+            return;
+        }
+        size_t pos = emit(kCellOffset);
+        patch32(pos + kCellOffsetDisp, offset);
+        patch32(pos + kCellOffsetMask, mask);
+    }
+};
+
+static void fastJitEmit(BfFastJitEmitter &e, const bf_insn *insns, size_t count,
+                        void (*writeByte)(BfRunner *, unsigned char),
+                        unsigned char (*readByte)(BfRunner *))
+{
+    // code offset just past each LB / LE, used to resolve the jumps
+    std::vector<size_t> ends(count);
+    size_t pos;
+
+    e.emit(kPrologue);
+    for (size_t i = 0; i < count; i++)
+    {
+        const bf_insn &insn = insns[i];
+        switch (insn.opcode)
+        {
+            case BF_INSN_AA:
+                pos = e.emit(kAa);
+                e.patch32(pos + kAaDisp, insn.operand);
+                e.patch32(pos + kAaMask, e.mask);
+                break;
+            case BF_INSN_VA:
+                e.emitCell(insn.offset);
+                pos = e.emit(kVa);
+                e.code[pos + kVaImm] = (uint8_t)insn.operand;
+                break;
+            case BF_INSN_SET:
+                e.emitCell(insn.offset);
+                pos = e.emit(kSet);
+                e.code[pos + kSetImm] = (uint8_t)insn.operand;
+                break;
+            case BF_INSN_MUL:
+                e.emitCell(insn.offset);
+                pos = e.emit(kMulLoad);
+                e.patch32(pos + kMulLoadImm, insn.operand);
+                e.emitCell(insn.target);
+                e.emit(kMulStore);
+                break;
+            case BF_INSN_VO:
+                e.emitCell(insn.offset);
+                pos = e.emit(kVo);
+                e.patch64(pos + kVoFunc, (const void *)writeByte);
+                break;
+            case BF_INSN_VI:
+                pos = e.emit(kVi);
+                e.patch64(pos + kViFunc, (const void *)readByte);
+                e.patch32(pos + kViDisp, insn.offset);
+                e.patch32(pos + kViMask, e.mask);
+                break;
+            case BF_INSN_SCAN:
+                pos = e.emit(kScan);
+                e.patch32(pos + kScanStride, insn.operand);
+                e.patch32(pos + kScanMask, e.mask);
+                e.patch64(pos + kScanFunc, (const void *)bf_scan);
+                break;
+            case BF_INSN_LB:
+                e.emit(kLb);
+                ends[i] = e.code.size();
+                break;
+            case BF_INSN_LE:
+            {
+                e.emit(kLe);
+                ends[i] = e.code.size();
+                size_t lb_end = ends[insn.operand];
+                e.patch32(lb_end - 4, (int32_t)(ends[i] - lb_end));
+                e.patch32(ends[i] - 4, (int32_t)(lb_end - ends[i]));
+                break;
+            }
+            default:
+                fprintf(stderr, "Error: Invalid instruction %d\n", insn.opcode);
+                exit(1);
+        }
+    }
+    e.emit(kEpilogue);
+}
+
+#endif
+
+BfRunnerFastJit::~BfRunnerFastJit()
+{
+    if (mCode)
+    {
+        munmap(mCode, mCodeSize);
+    }
+}
+
+void BfRunnerFastJit::compileCode()
+{
+    BfRunnerBfInsn::compileCode();
+
+#if defined(__x86_64__)
+    mTimer.start("JIT fast");
+    BfFastJitEmitter e;
+    e.mask = getTapeMask();
+    fastJitEmit(e, mProgram, mProgramSize, writeByte, readByte);
+
+    mCodeSize = e.code.size();
+    mCode = mmap(nullptr, mCodeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mCode == MAP_FAILED)
+    {
+        mCode = nullptr;
+        perror("mmap");
+        exit(1);
+    }
+    memcpy(mCode, e.code.data(), mCodeSize);
+    if (mprotect(mCode, mCodeSize, PROT_READ | PROT_EXEC) != 0)
+    {
+        perror("mprotect");
+        exit(1);
+    }
+    mTimer.stop();
+#else
+    fprintf(stderr, "Error: --fast-jit is only supported on x86-64\n");
+    exit(1);
+#endif
+}
+
+void BfRunnerFastJit::run()
+{
+    typedef void (*bfcode_t)(BfRunner *, uint8_t *);
+    BfTape tape(getTapeSize(), getTapeHugePages());
+
+    bfcode_t bfcode = reinterpret_cast<bfcode_t>(mCode);
+
+    mTimer.start("RUN native");
+    bfcode(this, tape.data());
+    mTimer.stop();
+}
@@ -0,0 +1,21 @@
+#ifndef __BF_RUNNER_FAST_JIT_H__
+#define __BF_RUNNER_FAST_JIT_H__
+
+#include "bf_runner_bf_insn.h"
+
+// Template JIT: stitches pre-assembled x86-64 snippets for each bf_insn
+// into an executable buffer, no LLVM involved.
+class BfRunnerFastJit : public BfRunnerBfInsn
+{
+public:
+    BfRunnerFastJit() = default;
+    ~BfRunnerFastJit() override;
+
+    void compileCode() override;
+    void run() override;
+private:
+    void *mCode {nullptr};
+    size_t mCodeSize {0};
+};
+
+#endif // __BF_RUNNER_FAST_JIT_H__
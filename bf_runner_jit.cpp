@@ -1,94 +1,306 @@
 #include "bf_runner_jit.h"
 #include "bf_llvm_ir.h"
+#include "bf_scan.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/IRReader/IRReader.h"
-#include "llvm/Support/MemoryBuffer.h"
-#include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/TargetSelect.h"
 
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Target/TargetMachine.h"
 
 using namespace llvm;
 using namespace llvm::orc;
 
-static void LlvmInitializeOnce()
+BfRunnerJit::BfRunnerJit()
+{
+    bfLlvmInitialize();
+}
+
+void BfRunnerJit::optimizeModule(Module &module, TargetMachine *tm)
+{
+    auto start = std::chrono::steady_clock::now();
+    bfLlvmIrOptimize(module, tm, mLlvmOptLevel);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::lock_guard<std::mutex> lock(mOptMutex);
+    mOptElapsed += elapsed;
+    mOptimized++;
+}
+
+std::string BfRunnerJit::cacheOptions(const JITTargetMachineBuilder &jtmb) const
+{
+    std::string options = "bf-jit-1 llvm-" LLVM_VERSION_STRING;
+    options += " " + jtmb.getTargetTriple().str();
+    options += " " + jtmb.getCPU() + " " + jtmb.getFeatures().getString();
+    options += " -O" + std::to_string(mOptLevel) + " --passes=" + mOptPasses;
+    options += " --llvm-opt=" + std::to_string(mLlvmOptLevel);
+    options += " --flush=" + std::to_string(getFlushPolicy());
+    options += " --tape-size=" + std::to_string(getTapeSize());
+    return options;
+}
+
+void BfRunnerJit::createJit(JITTargetMachineBuilder jtmb)
 {
-    // using atomic operations to ensure thread safety
-    static std::atomic<bool> initialized(false);
-    if (!initialized.exchange(true))
+    if (mLazy)
     {
-        InitializeNativeTarget();
-        InitializeNativeTargetAsmPrinter();
-        InitializeNativeTargetAsmParser();
+        // the compile-on-demand layer splits the module per function and
+        // puts a stub in front of each one
+        LLLazyJITBuilder builder;
+        builder.setJITTargetMachineBuilder(std::move(jtmb));
+        builder.setNumCompileThreads(mCompileThreads);
+        auto JITOrErr = builder.create();
+        if (!JITOrErr) {
+            errs() << "Error creating JIT: " << toString(JITOrErr.takeError()) << "\n";
+            exit(1);
+        }
+        mJIT = std::move(*JITOrErr);
+        return;
+    }
+
+    // with compile threads the default compile function is a
+    // ConcurrentIRCompiler, the cache is not used together with them
+    LLJITBuilder builder;
+    builder.setJITTargetMachineBuilder(std::move(jtmb));
+    builder.setNumCompileThreads(mCompileThreads);
+    if (mObjectCache)
+    {
+        BfJitObjectCache *cache = mObjectCache.get();
+        builder.setCompileFunctionCreator(
+            [cache](JITTargetMachineBuilder JTMB) -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>>
+            {
+                auto TM = JTMB.createTargetMachine();
+                if (!TM)
+                {
+                    return TM.takeError();
+                }
+                return std::make_unique<TMOwningSimpleCompiler>(std::move(*TM), cache);
+            });
+    }
+
+    auto JITOrErr = builder.create();
+    if (!JITOrErr) {
+        errs() << "Error creating JIT: " << toString(JITOrErr.takeError()) << "\n";
+        exit(1);
     }
+    mJIT = std::move(*JITOrErr);
 }
 
-BfRunnerJit::BfRunnerJit()
+// looking up all functions at once lets the session materialize them in
+// parallel when there are compile threads
+void BfRunnerJit::lookupBfCode(const std::vector<std::string> &loops)
 {
-    LlvmInitializeOnce();
+    SymbolStringPtr bfcode = mJIT->mangleAndIntern("bfcode");
+    SymbolLookupSet names(bfcode);
+    for (const auto &loop : loops)
+    {
+        names.add(mJIT->mangleAndIntern(loop));
+    }
+
+    auto Syms = mJIT->getExecutionSession().lookup(makeJITDylibSearchOrder(&mJIT->getMainJITDylib()), std::move(names));
+    if (!Syms)
+    {
+        errs() << "Error looking up symbol 'bfcode': " << toString(Syms.takeError()) << "\n";
+        exit(1);
+    }
+    mBfCodeAddress = (*Syms)[bfcode].getAddress();
+}
+
+bool BfRunnerJit::loadCachedObject(JITTargetMachineBuilder jtmb)
+{
+    mTimer.start("JIT cache");
+    auto object = mObjectCache->load();
+    if (!object)
+    {
+        mTimer.stop();
+        mTimer.note("miss");
+        return false;
+    }
+
+    createJit(std::move(jtmb));
+    if (auto Err = mJIT->addObjectFile(std::move(object)))
+    {
+        // compile as on a miss, which also replaces the entry
+        errs() << "Warning: Ignoring JIT cache entry: " << toString(std::move(Err)) << "\n";
+        mObjectCache->remove();
+        mJIT.reset();
+        mTimer.stop();
+        mTimer.note("miss");
+        return false;
+    }
+    lookupBfCode();
+    mTimer.stop();
+    mTimer.note("hit");
+    return true;
 }
 
 void BfRunnerJit::compileCode()
 {
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+    {
+        errs() << "Error detecting host: " << toString(JTMB.takeError()) << "\n";
+        exit(1);
+    }
+    BfLlvmTarget target = bfLlvmTarget(mMarch, mMattr);
+    JTMB->setCPU(target.cpu);
+    JTMB->getFeatures() = SubtargetFeatures(target.features);
+
+    // a hit skips parsing, IR generation and codegen altogether; --emit-ir
+    // needs the IR, so it always compiles (and refreshes the entry)
+    if (!mCacheDir.empty())
+    {
+        mObjectCache = std::make_unique<BfJitObjectCache>(mCacheDir);
+        mObjectCache->setKey(BfJitObjectCache::makeKey(mSourceCode.data(), mSourceCode.size(), cacheOptions(*JTMB)));
+        if (!mEnableIrEmit && loadCachedObject(*JTMB))
+        {
+            return;
+        }
+    }
+
     BfRunnerBfInsn::compileCode();
 
     mTimer.start("GEN llvm-ir");
-    std::string llvmIr = bfLlvmIrGenerate(mInsns);
+    auto Context = std::make_unique<LLVMContext>();
+    // value names only matter for the .ll dump
+    Context->setDiscardValueNames(!mEnableIrEmit);
+    BfLlvmIrOptions irOptions;
+    irOptions.lineFlush = getFlushPolicy() == BF_FLUSH_LINE;
+    irOptions.tapeSize = getTapeSize();
+    irOptions.outlineLoops = mLazy || mCompileThreads > 0;
+    // eagerly compiled loops get a module and a context each, as the compile
+    // layer holds the context lock while working on a module
+    irOptions.declareLoops = !mLazy && mCompileThreads > 0;
+    auto M = bfLlvmIrGenerate(mProgram, mProgramSize, *Context, irOptions);
+    std::vector<std::string> loopNames;
+    std::vector<ThreadSafeModule> loopModules;
+    if (irOptions.declareLoops)
+    {
+        for (size_t i = 0; i < mProgramSize; i++)
+        {
+            if (mProgram[i].opcode == BF_INSN_LB)
+            {
+                auto LoopContext = std::make_unique<LLVMContext>();
+                LoopContext->setDiscardValueNames(true);
+                loopNames.push_back("bfloop_" + std::to_string(i));
+                auto LM = bfLlvmIrGenerateLoop(mProgram, i, *LoopContext, irOptions, loopNames.back());
+                loopModules.emplace_back(std::move(LM), std::move(LoopContext));
+                i = mProgram[i].operand;
+            }
+        }
+    }
+    mFunctions = loopModules.size();
+    for (const auto &F : *M)
+    {
+        mFunctions += !F.isDeclaration();
+    }
     mTimer.stop();
 
     if (mEnableIrEmit)
     {
-        bfLlvmIrDumpToFile(mSourcePath, llvmIr);
+        if (irOptions.declareLoops)
+        {
+            // dump the same functions as one module
+            LLVMContext dumpContext;
+            irOptions.declareLoops = false;
+            bfLlvmIrDumpToFile(mSourcePath, *bfLlvmIrGenerate(mProgram, mProgramSize, dumpContext, irOptions));
+        }
+        else
+        {
+            bfLlvmIrDumpToFile(mSourcePath, *M);
+        }
     }
 
     mTimer.start("JIT compile");
-    auto Buffer = MemoryBuffer::getMemBuffer(llvmIr, "in_memory_ir");
-    SMDiagnostic Err;
-    auto M = parseIR(Buffer->getMemBufferRef(), Err, mContext);
-    if (!M)
+
+    // the optimizer uses its own target machine for cost models
+    auto TM = JTMB->createTargetMachine();
+    if (!TM)
     {
-        errs() << "Error parsing IR: " << Err.getMessage() << "\n";
+        errs() << "Error creating target machine: " << toString(TM.takeError()) << "\n";
         exit(1);
     }
+    std::shared_ptr<TargetMachine> optTM = std::move(*TM);
+    JITTargetMachineBuilder optJTMB = *JTMB;
 
-    auto JITOrErr = LLJITBuilder().create();
-    if (!JITOrErr) {
-        errs() << "Error creating JIT: " << toString(JITOrErr.takeError()) << "\n";
-        exit(1);
+    createJit(std::move(*JTMB));
+
+    if (mLlvmOptLevel > 0)
+    {
+        mJIT->getIRTransformLayer().setTransform(
+            [this, optTM, optJTMB](ThreadSafeModule TSM, const MaterializationResponsibility &) -> Expected<ThreadSafeModule>
+            {
+                // a target machine caches subtargets and must not be shared
+                // between compile threads
+                std::shared_ptr<TargetMachine> tm = optTM;
+                if (mCompileThreads > 0)
+                {
+                    JITTargetMachineBuilder jtmb = optJTMB;
+                    auto TM = jtmb.createTargetMachine();
+                    if (!TM)
+                    {
+                        return TM.takeError();
+                    }
+                    tm = std::move(*TM);
+                }
+                TSM.withModuleDo([this, &tm](Module &M) { optimizeModule(M, tm.get()); });
+                return TSM;
+            });
     }
-    mJIT = std::move(*JITOrErr);
 
-    if (auto Err = mJIT->addIRModule(ThreadSafeModule(std::move(M), std::make_unique<LLVMContext>())))
+    ThreadSafeModule TSM(std::move(M), std::move(Context));
+    Error Err = mLazy ? static_cast<LLLazyJIT &>(*mJIT).addLazyIRModule(std::move(TSM))
+                      : mJIT->addIRModule(std::move(TSM));
+    for (auto &LM : loopModules)
+    {
+        Err = joinErrors(std::move(Err), mJIT->addIRModule(std::move(LM)));
+    }
+    if (Err)
     {
         errs() << "Error adding module: " << toString(std::move(Err)) << "\n";
         exit(1);
     }
 
     mTimer.stop();
-}
 
-void BfRunnerJit::run()
-{
-    typedef void (*writeByte_t)(BfRunner*, unsigned char);
-    typedef unsigned char (*readByte_t)(BfRunner*);
-    typedef void (*bfcode_t)(BfRunner*, uint8_t*, readByte_t, writeByte_t);
-    std::vector<uint8_t> memory(BF_MEM_SIZE, 0);
+    // materializing the symbol runs the optimizer and the code generator,
+    // which also stores the object in the cache; lazily only for bfcode,
+    // the loops are compiled while running and reported after the run
+    mTimer.start("JIT codegen");
+    lookupBfCode(loopNames);
+    mTimer.stop();
+    if (mCompileThreads > 0)
+    {
+        mTimer.note(std::to_string(mCompileThreads) + " threads");
+    }
 
-    auto Sym = mJIT->lookup("bfcode");
-    if (!Sym)
+    if (mLlvmOptLevel > 0 && !mLazy)
     {
-        errs() << "Error looking up symbol 'bfcode': " << toString(Sym.takeError()) << "\n";
-        exit(1);
+        // summed over the compile threads
+        mTimer.record("JIT opt", mOptElapsed);
+        mTimer.note(std::to_string(mOptimized) + " modules");
     }
+}
+
+void BfRunnerJit::run()
+{
+    typedef uint32_t (*scan_t)(const uint8_t*, uint32_t, int32_t, uint32_t);
+    typedef void (*bfcode_t)(bf_io*, uint8_t*, scan_t);
+    BfTape tape(getTapeSize(), getTapeHugePages());
 
-    bfcode_t bfcode = reinterpret_cast<bfcode_t>(Sym->getAddress());
-    readByte_t readByte = BfRunner::readByte;
-    writeByte_t writeByte = BfRunner::writeByte;
+    bfcode_t bfcode = reinterpret_cast<bfcode_t>(mBfCodeAddress);
 
     mTimer.start("RUN native");
-    bfcode(this, memory.data(), readByte, writeByte);
+    bfcode(getIo(), tape.data(), bf_scan);
     mTimer.stop();
+
+    if (mLazy && mLlvmOptLevel > 0)
+    {
+        mTimer.record("JIT opt", mOptElapsed);
+        char note[64];
+        snprintf(note, sizeof(note), "%u of %u functions compiled", mOptimized, mFunctions);
+        mTimer.note(note);
+    }
 }
\ No newline at end of file
@@ -2,7 +2,10 @@
 #define BF_RUNNER_JIT_H
 
 #include "bf_runner_bf_insn.h"
+#include "bf_jit_cache.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include <mutex>
+#include <vector>
 
 class BfRunnerJit : public BfRunnerBfInsn
 {
@@ -10,11 +13,63 @@ public:
     BfRunnerJit();
     ~BfRunnerJit() override = default;
 
+    void setLlvmOptLevel(int level)
+    {
+        mLlvmOptLevel = level;
+    }
+
+    // keep compiled objects in dir across runs, empty disables the cache
+    void setCacheDir(const std::string &dir)
+    {
+        mCacheDir = dir;
+    }
+
+    // outline top-level loops and compile each one on its first call
+    void setLazy(bool lazy)
+    {
+        mLazy = lazy;
+    }
+
+    // optimize and generate code for the outlined loops on n threads,
+    // 0 compiles everything on the calling thread
+    void setCompileThreads(unsigned n)
+    {
+        mCompileThreads = n;
+    }
+
+    // CPU and features to generate code for, see bfLlvmTarget(); an empty
+    // march keeps the default, native
+    void setTarget(const std::string &march, const std::string &mattr)
+    {
+        if (!march.empty())
+        {
+            mMarch = march;
+        }
+        mMattr = mattr;
+    }
+
     void compileCode() override;
     void run() override;
 private:
-    llvm::LLVMContext mContext;
+    void optimizeModule(llvm::Module &module, llvm::TargetMachine *tm);
+    std::string cacheOptions(const llvm::orc::JITTargetMachineBuilder &jtmb) const;
+    bool loadCachedObject(llvm::orc::JITTargetMachineBuilder jtmb);
+    void createJit(llvm::orc::JITTargetMachineBuilder jtmb);
+    void lookupBfCode(const std::vector<std::string> &loops = {});
+
     std::unique_ptr<llvm::orc::LLJIT> mJIT;
+    int mLlvmOptLevel {2};
+    std::chrono::steady_clock::duration mOptElapsed {};
+    bool mLazy {false};
+    unsigned mCompileThreads {0};
+    std::mutex mOptMutex;
+    unsigned mFunctions {0};
+    unsigned mOptimized {0};
+    uint64_t mBfCodeAddress {0};
+    std::string mCacheDir;
+    std::string mMarch {"native"};
+    std::string mMattr;
+    std::unique_ptr<BfJitObjectCache> mObjectCache;
 };
 
 #endif // BF_RUNNER_JIT_H
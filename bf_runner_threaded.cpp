@@ -0,0 +1,123 @@
+#include "bf_runner_threaded.h"
+#include "bf_scan.h"
+
+enum
+{
+    BF_THREADED_HALT = BF_INSN_MAX,
+    BF_THREADED_MAX,
+};
+
+void BfRunnerThreaded::execute(BfRunner *runner, const BfThreadedInsn *code, uint8_t *memory, const void *const **handlers)
+{
+    // indexed by opcode, same order as the BF_INSN_* enum
+    static const void *const labels[BF_THREADED_MAX] =
+    {
+        &&do_aa,
+        &&do_va,
+        &&do_vi,
+        &&do_vo,
+        &&do_lb,
+        &&do_le,
+        &&do_set,
+        &&do_mul,
+        &&do_scan,
+        &&do_halt,
+    };
+
+    if (handlers)
+    {
+        *handlers = labels;
+        return;
+    }
+
+    const BfThreadedInsn *ip = code;
+    uint32_t addr = 0;
+    const uint32_t mask = runner->getTapeMask();
+
+#define BF_CELL(off) memory[(addr + (off)) & mask]
+#define BF_NEXT() goto *(++ip)->handler
+
+    goto *ip->handler;
+
+do_aa:
+    addr = (addr + ip->operand) & mask;
+    BF_NEXT();
+do_va:
+    BF_CELL(ip->offset) += ip->operand;
+    BF_NEXT();
+do_vi:
+    BF_CELL(ip->offset) = readByte(runner);
+    BF_NEXT();
+do_vo:
+    writeByte(runner, BF_CELL(ip->offset));
+    BF_NEXT();
+do_lb:
+    if (memory[addr] == 0)
+    {
+        ip = ip->jump;
+        goto *ip->handler;
+    }
+    BF_NEXT();
+do_le:
+    if (memory[addr] != 0)
+    {
+        ip = ip->jump;
+        goto *ip->handler;
+    }
+    BF_NEXT();
+do_set:
+    BF_CELL(ip->offset) = ip->operand;
+    BF_NEXT();
+do_mul:
+    BF_CELL(ip->target) += BF_CELL(ip->offset) * ip->operand;
+    BF_NEXT();
+do_scan:
+    addr = bf_scan(memory, addr, ip->operand, mask);
+    BF_NEXT();
+do_halt:
+    return;
+
+#undef BF_NEXT
+#undef BF_CELL
+}
+
+void BfRunnerThreaded::compileCode()
+{
+    BfRunnerBfInsn::compileCode();
+
+    mTimer.start("GEN threaded");
+    const void *const *handlers;
+    execute(this, nullptr, nullptr, &handlers);
+
+    // sized up front, jump holds pointers into the vector
+    mCode.assign(mProgramSize + 1, BfThreadedInsn());
+    for (size_t i = 0; i < mProgramSize; i++)
+    {
+        const bf_insn &insn = mProgram[i];
+        if (insn.opcode < 0 || insn.opcode >= BF_INSN_MAX)
+        {
+            fprintf(stderr, "Error: Invalid instruction %d\n", insn.opcode);
+            exit(1);
+        }
+        BfThreadedInsn &out = mCode[i];
+        out.handler = handlers[insn.opcode];
+        out.operand = insn.operand;
+        out.offset = insn.offset;
+        out.target = insn.target;
+        if (insn.opcode == BF_INSN_LB || insn.opcode == BF_INSN_LE)
+        {
+            out.jump = &mCode[insn.operand + 1];
+        }
+    }
+    mCode.back().handler = handlers[BF_THREADED_HALT];
+    mTimer.stop();
+}
+
+void BfRunnerThreaded::run()
+{
+    BfTape tape(getTapeSize(), getTapeHugePages());
+
+    mTimer.start("RUN threaded");
+    execute(this, mCode.data(), tape.data(), nullptr);
+    mTimer.stop();
+}
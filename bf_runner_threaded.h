@@ -0,0 +1,29 @@
+#ifndef __BF_RUNNER_THREADED_H__
+#define __BF_RUNNER_THREADED_H__
+
+#include "bf_runner_bf_insn.h"
+
+class BfRunnerThreaded : public BfRunnerBfInsn
+{
+public:
+    BfRunnerThreaded() = default;
+    ~BfRunnerThreaded() override = default;
+
+    void compileCode() override;
+    void run() override;
+
+    // one entry of the pre-decoded stream, handler is a label inside execute()
+    struct BfThreadedInsn
+    {
+        const void *handler;
+        int32_t operand;
+        int32_t offset;
+        int32_t target;
+        const BfThreadedInsn *jump; // LB/LE: instruction after the partner
+    };
+private:
+    static void execute(BfRunner *runner, const BfThreadedInsn *code, uint8_t *memory, const void *const **handlers);
+    std::vector<BfThreadedInsn> mCode;
+};
+
+#endif // __BF_RUNNER_THREADED_H__
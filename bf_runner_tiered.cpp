@@ -0,0 +1,236 @@
+#include "bf_runner_tiered.h"
+#include "bf_llvm_ir.h"
+#include "bf_scan.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+BfRunnerTiered::BfRunnerTiered()
+{
+    bfLlvmInitialize();
+}
+
+BfRunnerTiered::~BfRunnerTiered()
+{
+    stopWorker();
+}
+
+void BfRunnerTiered::compileCode()
+{
+    BfRunnerBfInsn::compileCode();
+
+    mBackEdges.assign(mProgramSize, 0);
+    mLoops.reset(new std::atomic<loop_t>[mProgramSize]);
+    for (size_t i = 0; i < mProgramSize; i++)
+    {
+        mLoops[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    // on this thread, so a bad --march or --mattr fails before the run
+    mTimer.start("JIT setup");
+    createJit();
+    mTimer.stop();
+}
+
+void BfRunnerTiered::createJit()
+{
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+    {
+        errs() << "Error detecting host: " << toString(JTMB.takeError()) << "\n";
+        exit(1);
+    }
+    BfLlvmTarget target = bfLlvmTarget(mMarch, mMattr);
+    JTMB->setCPU(target.cpu);
+    JTMB->getFeatures() = SubtargetFeatures(target.features);
+    auto TM = JTMB->createTargetMachine();
+    if (!TM)
+    {
+        errs() << "Error creating target machine: " << toString(TM.takeError()) << "\n";
+        exit(1);
+    }
+    std::shared_ptr<TargetMachine> optTM = std::move(*TM);
+
+    auto JITOrErr = LLJITBuilder().setJITTargetMachineBuilder(std::move(*JTMB)).create();
+    if (!JITOrErr) {
+        errs() << "Error creating JIT: " << toString(JITOrErr.takeError()) << "\n";
+        exit(1);
+    }
+    mJIT = std::move(*JITOrErr);
+
+    if (mLlvmOptLevel > 0)
+    {
+        int level = mLlvmOptLevel;
+        mJIT->getIRTransformLayer().setTransform(
+            [level, optTM](ThreadSafeModule TSM, const MaterializationResponsibility &) -> Expected<ThreadSafeModule>
+            {
+                TSM.withModuleDo([level, &optTM](Module &M) { bfLlvmIrOptimize(M, optTM.get(), level); });
+                return TSM;
+            });
+    }
+}
+
+void BfRunnerTiered::requestCompile(uint32_t lb)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(lb);
+    }
+    mWake.notify_one();
+}
+
+void BfRunnerTiered::compileWorker()
+{
+    BfLlvmIrOptions irOptions;
+    irOptions.lineFlush = getFlushPolicy() == BF_FLUSH_LINE;
+    irOptions.tapeSize = getTapeSize();
+
+    for (;;)
+    {
+        uint32_t lb;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWake.wait(lock, [this] { return mStop || !mQueue.empty(); });
+            if (mStop)
+            {
+                return;
+            }
+            lb = mQueue.front();
+            mQueue.pop_front();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::string name = "bfloop_" + std::to_string(lb);
+        auto context = std::make_unique<LLVMContext>();
+        context->setDiscardValueNames(true);
+        auto module = bfLlvmIrGenerateLoop(mProgram, lb, *context, irOptions, name);
+        // never exit() here: that would run ~BfRunnerTiered on this thread,
+        // which cannot join itself; run() reports the error instead
+        std::string error;
+        if (auto Err = mJIT->addIRModule(ThreadSafeModule(std::move(module), std::move(context))))
+        {
+            error = "Cannot add module '" + name + "': " + toString(std::move(Err));
+        }
+        else if (auto Sym = mJIT->lookup(name))
+        {
+            mLoops[lb].store(reinterpret_cast<loop_t>(Sym->getAddress()), std::memory_order_release);
+        }
+        else
+        {
+            error = "Cannot look up symbol '" + name + "': " + toString(Sym.takeError());
+        }
+        if (!error.empty())
+        {
+            // stop promoting, the remaining loops stay interpreted
+            std::lock_guard<std::mutex> lock(mMutex);
+            mWorkerError = error;
+            return;
+        }
+
+        mCompileElapsed += std::chrono::steady_clock::now() - start;
+        mCompiled++;
+    }
+}
+
+void BfRunnerTiered::stopWorker()
+{
+    if (!mWorker.joinable() || mWorker.get_id() == std::this_thread::get_id())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_one();
+    mWorker.join();
+}
+
+void BfRunnerTiered::run()
+{
+    mTimer.start("RUN tiered");
+
+    unsigned int pc = 0;
+    unsigned int addr = 0;
+    unsigned int hot = 0;
+    BfTape tape(getTapeSize(), getTapeHugePages());
+    uint8_t *memory = tape.data();
+    const uint32_t mask = getTapeMask();
+    bf_io *io = getIo();
+    mWorker = std::thread(&BfRunnerTiered::compileWorker, this);
+
+    while (pc < mProgramSize)
+    {
+        const bf_insn &insn = mProgram[pc];
+        switch (insn.opcode)
+        {
+            case BF_INSN_AA:
+                addr = (addr + insn.operand) & mask;
+                break;
+            case BF_INSN_VA:
+                memory[(addr + insn.offset) & mask] += insn.operand;
+                break;
+            case BF_INSN_VI:
+                memory[(addr + insn.offset) & mask] = readByte(this);
+                break;
+            case BF_INSN_VO:
+                writeByte(this, memory[(addr + insn.offset) & mask]);
+                break;
+            case BF_INSN_LB:
+                if (memory[addr] == 0)
+                {
+                    pc = insn.operand;
+                }
+                else if (loop_t loop = mLoops[pc].load(std::memory_order_acquire))
+                {
+                    // the compiled loop runs to its exit, continue after LE
+                    addr = loop(io, memory, bf_scan, addr);
+                    pc = insn.operand;
+                }
+                break;
+            case BF_INSN_LE:
+                if (memory[addr] != 0)
+                {
+                    uint32_t lb = insn.operand;
+                    if (loop_t loop = mLoops[lb].load(std::memory_order_acquire))
+                    {
+                        addr = loop(io, memory, bf_scan, addr);
+                    }
+                    else
+                    {
+                        pc = lb;
+                        if (++mBackEdges[lb] == mThreshold)
+                        {
+                            requestCompile(lb);
+                            hot++;
+                        }
+                    }
+                }
+                break;
+            case BF_INSN_SET:
+                memory[(addr + insn.offset) & mask] = insn.operand;
+                break;
+            case BF_INSN_MUL:
+                memory[(addr + insn.target) & mask] += memory[(addr + insn.offset) & mask] * insn.operand;
+                break;
+            case BF_INSN_SCAN:
+                addr = bf_scan(memory, addr, insn.operand, mask);
+                break;
+            default:
+                fprintf(stderr, "Error: Invalid instruction %d\n", insn.opcode);
+                exit(1);
+        }
+        pc++;
+    }
+
+    mTimer.stop();
+    stopWorker();
+    if (!mWorkerError.empty())
+    {
+        fprintf(stderr, "Warning: Tiered JIT stopped, loops stay interpreted: %s\n", mWorkerError.c_str());
+    }
+    mTimer.note(std::to_string(mCompiled) + " of " + std::to_string(hot) + " hot loops compiled");
+    mTimer.record("JIT tiered", mCompileElapsed);
+}
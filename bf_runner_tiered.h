@@ -0,0 +1,78 @@
+#ifndef __BF_RUNNER_TIERED_H__
+#define __BF_RUNNER_TIERED_H__
+
+#include "bf_runner_bf_insn.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define BF_TIERED_THRESHOLD 1000
+
+// Interprets right away, counting back-edges per loop. Loops that get hot
+// are compiled by a background LLVM thread and entered at their next head.
+class BfRunnerTiered : public BfRunnerBfInsn
+{
+public:
+    BfRunnerTiered();
+    ~BfRunnerTiered() override;
+
+    void setLlvmOptLevel(int level)
+    {
+        mLlvmOptLevel = level;
+    }
+
+    // back-edges before a loop is sent to the compiler
+    void setThreshold(uint32_t threshold)
+    {
+        mThreshold = threshold;
+    }
+
+    // CPU and features to generate code for, see bfLlvmTarget(); an empty
+    // march keeps the default, native
+    void setTarget(const std::string &march, const std::string &mattr)
+    {
+        if (!march.empty())
+        {
+            mMarch = march;
+        }
+        mMattr = mattr;
+    }
+
+    void compileCode() override;
+    void run() override;
+private:
+    typedef uint32_t (*scan_t)(const uint8_t *, uint32_t, int32_t, uint32_t);
+    typedef uint32_t (*loop_t)(bf_io *, uint8_t *, scan_t, uint32_t);
+
+    void requestCompile(uint32_t lb);
+    void compileWorker();
+    void createJit();
+    void stopWorker();
+
+    int mLlvmOptLevel {2};
+    uint32_t mThreshold {BF_TIERED_THRESHOLD};
+    std::string mMarch {"native"};
+    std::string mMattr;
+    // indexed by LB position
+    std::vector<uint32_t> mBackEdges;
+    std::unique_ptr<std::atomic<loop_t>[]> mLoops;
+
+    // created by compileCode(), used by the worker while it runs
+    std::unique_ptr<llvm::orc::LLJIT> mJIT;
+    std::chrono::steady_clock::duration mCompileElapsed {};
+    unsigned mCompiled {0};
+
+    std::thread mWorker;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<uint32_t> mQueue;
+    bool mStop {false};
+    // set by the worker when it gives up, under mMutex
+    std::string mWorkerError;
+};
+
+#endif // __BF_RUNNER_TIERED_H__
@@ -0,0 +1,275 @@
+#include "bf_scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BF_SCAN_X86 1
+#endif
+
+// Each kernel looks at p[0], p[s], ..., p[(count - 1) * s] (forward) or
+// p[0], p[-s], ... (backward) and returns the index of the first zero
+// cell, or count if there is none.
+typedef uint64_t (*scan_func)(const uint8_t *p, uint64_t count, uint32_t s);
+
+static uint64_t scanForwardScalar(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1)
+    {
+        const void *hit = memchr(p, 0, count);
+        return hit ? (const uint8_t *)hit - p : count;
+    }
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (p[i * s] == 0)
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+static uint64_t scanBackwardScalar(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1)
+    {
+        const void *hit = memrchr(p - count + 1, 0, count);
+        return hit ? p - (const uint8_t *)hit : count;
+    }
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (*(p - i * s) == 0)
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+// cells visited by one chunk of width bytes: bits 0, s, 2s, ...
+static uint64_t stridePattern(uint32_t s, uint32_t width, uint32_t *cells)
+{
+    uint64_t pattern = 0;
+    uint32_t n = width / s;
+    for (uint32_t j = 0; j < n; j++)
+    {
+        pattern |= 1ull << (j * s);
+    }
+    *cells = n;
+    return pattern;
+}
+
+#ifdef BF_SCAN_X86
+
+static uint64_t scanForwardSse2(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1 || s > 8)
+    {
+        return scanForwardScalar(p, count, s);
+    }
+    uint32_t n;
+    uint32_t pattern = (uint32_t)stridePattern(s, 16, &n);
+    uint64_t i = 0;
+    for (; i * s + 16 <= (count - 1) * s + 1; i += n)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * s));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & pattern;
+        if (mask)
+        {
+            return i + __builtin_ctz(mask) / s;
+        }
+    }
+    return i + scanForwardScalar(p + i * s, count - i, s);
+}
+
+static uint64_t scanBackwardSse2(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1 || s > 8)
+    {
+        return scanBackwardScalar(p, count, s);
+    }
+    uint32_t n;
+    // cells sit at the top of the chunk: bits 15, 15 - s, ...
+    uint32_t pattern = (uint32_t)stridePattern(s, 16, &n) << (16 - (n - 1) * s - 1);
+    uint64_t i = 0;
+    for (; i * s + 16 <= (count - 1) * s + 1; i += n)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p - i * s - 15));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & pattern;
+        if (mask)
+        {
+            return i + (__builtin_clz(mask) - 16) / s;
+        }
+    }
+    return i + scanBackwardScalar(p - i * s, count - i, s);
+}
+
+__attribute__((target("avx2")))
+static uint64_t scanForwardAvx2(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1 || s > 16)
+    {
+        return scanForwardScalar(p, count, s);
+    }
+    uint32_t n;
+    uint32_t pattern = (uint32_t)stridePattern(s, 32, &n);
+    uint64_t i = 0;
+    for (; i * s + 32 <= (count - 1) * s + 1; i += n)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * s));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) & pattern;
+        if (mask)
+        {
+            return i + __builtin_ctz(mask) / s;
+        }
+    }
+    return i + scanForwardScalar(p + i * s, count - i, s);
+}
+
+__attribute__((target("avx2")))
+static uint64_t scanBackwardAvx2(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1 || s > 16)
+    {
+        return scanBackwardScalar(p, count, s);
+    }
+    uint32_t n;
+    uint32_t pattern = (uint32_t)stridePattern(s, 32, &n) << (32 - (n - 1) * s - 1);
+    uint64_t i = 0;
+    for (; i * s + 32 <= (count - 1) * s + 1; i += n)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p - i * s - 31));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) & pattern;
+        if (mask)
+        {
+            return i + __builtin_clz(mask) / s;
+        }
+    }
+    return i + scanBackwardScalar(p - i * s, count - i, s);
+}
+
+__attribute__((target("avx512bw")))
+static uint64_t scanForwardAvx512(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1 || s > 32)
+    {
+        return scanForwardScalar(p, count, s);
+    }
+    uint32_t n;
+    uint64_t pattern = stridePattern(s, 64, &n);
+    uint64_t i = 0;
+    for (; i * s + 64 <= (count - 1) * s + 1; i += n)
+    {
+        __m512i v = _mm512_loadu_si512((const void *)(p + i * s));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512()) & pattern;
+        if (mask)
+        {
+            return i + __builtin_ctzll(mask) / s;
+        }
+    }
+    return i + scanForwardScalar(p + i * s, count - i, s);
+}
+
+__attribute__((target("avx512bw")))
+static uint64_t scanBackwardAvx512(const uint8_t *p, uint64_t count, uint32_t s)
+{
+    if (s == 1 || s > 32)
+    {
+        return scanBackwardScalar(p, count, s);
+    }
+    uint32_t n;
+    uint64_t pattern = stridePattern(s, 64, &n) << (64 - (n - 1) * s - 1);
+    uint64_t i = 0;
+    for (; i * s + 64 <= (count - 1) * s + 1; i += n)
+    {
+        __m512i v = _mm512_loadu_si512((const void *)(p - i * s - 63));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512()) & pattern;
+        if (mask)
+        {
+            return i + __builtin_clzll(mask) / s;
+        }
+    }
+    return i + scanBackwardScalar(p - i * s, count - i, s);
+}
+
+#endif
+
+struct BfScanKernels
+{
+    scan_func forward;
+    scan_func backward;
+};
+
+static BfScanKernels selectKernels()
+{
+#ifdef BF_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        return {scanForwardAvx512, scanBackwardAvx512};
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return {scanForwardAvx2, scanBackwardAvx2};
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return {scanForwardSse2, scanBackwardSse2};
+    }
+#endif
+    return {scanForwardScalar, scanBackwardScalar};
+}
+
+extern "C" uint32_t bf_scan(const uint8_t *memory, uint32_t addr, int32_t stride, uint32_t mask)
+{
+    static const BfScanKernels kernels = selectKernels();
+    uint64_t size = (uint64_t)mask + 1;
+
+    // fold the stride into (-size / 2, size / 2]
+    int64_t step = (uint32_t)stride & mask;
+    if (step > (int64_t)(size / 2))
+    {
+        step -= size;
+    }
+
+    if (step != 0)
+    {
+        uint32_t s = step > 0 ? step : -step;
+        // the walk returns to addr after size / gcd(s, size) cells
+        uint64_t remaining = size / (s & -s);
+
+        while (remaining)
+        {
+            uint64_t count;
+            uint64_t i;
+            if (step > 0)
+            {
+                count = (uint64_t)(mask - addr) / s + 1;
+                count = count < remaining ? count : remaining;
+                i = kernels.forward(memory + addr, count, s);
+                if (i < count)
+                {
+                    return addr + (uint32_t)(i * s);
+                }
+                addr = (uint32_t)(addr + count * s) & mask;
+            }
+            else
+            {
+                count = (uint64_t)addr / s + 1;
+                count = count < remaining ? count : remaining;
+                i = kernels.backward(memory + addr, count, s);
+                if (i < count)
+                {
+                    return addr - (uint32_t)(i * s);
+                }
+                addr = (uint32_t)(addr - count * s) & mask;
+            }
+            remaining -= count;
+        }
+    }
+
+    // no zero cell on the walk: the program never leaves this loop
+    while (*(volatile const uint8_t *)(memory + addr) != 0)
+    {
+    }
+    return addr;
+}
@@ -0,0 +1,14 @@
+#ifndef __bf_scan_h__
+#define __bf_scan_h__
+
+#include <stdint.h>
+
+// Execute a [>..>] / [<..<] loop: starting at addr, step by stride
+// (wrapping with mask, the tape size - 1) until a zero cell is found and
+// return its address. Shared by the interpreter and generated code.
+#ifdef __cplusplus
+extern "C"
+#endif
+uint32_t bf_scan(const uint8_t *memory, uint32_t addr, int32_t stride, uint32_t mask);
+
+#endif
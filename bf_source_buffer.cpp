@@ -0,0 +1,125 @@
+#include "bf_source_buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BF_SOURCE_READ_CHUNK (1 << 16)
+
+BfSourceBuffer::~BfSourceBuffer()
+{
+    reset();
+}
+
+void BfSourceBuffer::reset()
+{
+    if (mMapBase)
+    {
+        munmap(mMapBase, mMapSize);
+        mMapBase = nullptr;
+        mMapSize = 0;
+    }
+    free(mHeap);
+    mHeap = nullptr;
+    mData = "";
+    mSize = 0;
+}
+
+static char *streamCode(int fd, size_t *size)
+{
+    size_t capacity = BF_SOURCE_READ_CHUNK;
+    size_t len = 0;
+    char *code = (char *)malloc(capacity);
+
+    for (;;)
+    {
+        if (!code)
+        {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        if (capacity - len < BF_SOURCE_READ_CHUNK)
+        {
+            capacity *= 2;
+            code = (char *)realloc(code, capacity);
+            continue;
+        }
+        ssize_t n = read(fd, code + len, BF_SOURCE_READ_CHUNK);
+        if (n < 0)
+        {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        len += n;
+    }
+    *size = len;
+    return code;
+}
+
+void BfSourceBuffer::load(const std::string &path)
+{
+    reset();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("Error reading file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED)
+        {
+            madvise(base, st.st_size, MADV_SEQUENTIAL);
+            mMapBase = base;
+            mMapSize = st.st_size;
+            mData = (const char *)base;
+            mSize = st.st_size;
+            close(fd);
+            return;
+        }
+    }
+
+    size_t size;
+    char *code = streamCode(fd, &size);
+    close(fd);
+    adopt(code, size);
+}
+
+void BfSourceBuffer::adopt(char *buffer, size_t size)
+{
+    reset();
+    mHeap = buffer;
+    mData = buffer;
+    mSize = size;
+}
+
+void BfSourceBuffer::discard(size_t len)
+{
+    if (!mMapBase)
+    {
+        return;
+    }
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    len -= len % pageSize;
+    if (len)
+    {
+        madvise(mMapBase, len, MADV_DONTNEED);
+    }
+}
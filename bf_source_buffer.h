@@ -0,0 +1,50 @@
+#ifndef __bf_source_buffer_h__
+#define __bf_source_buffer_h__
+
+#include <string>
+#include <stddef.h>
+
+// Program text. Regular files are mapped read-only and used in place,
+// anything else (pipes, ttys) is streamed into a heap buffer.
+class BfSourceBuffer
+{
+public:
+    BfSourceBuffer() = default;
+    ~BfSourceBuffer();
+    BfSourceBuffer(const BfSourceBuffer &) = delete;
+    BfSourceBuffer &operator=(const BfSourceBuffer &) = delete;
+
+    void load(const std::string &path);
+
+    // take ownership of a malloc()ed buffer, dropping the previous contents
+    void adopt(char *buffer, size_t size);
+
+    // tell the kernel the first len bytes will not be read again
+    void discard(size_t len);
+
+    const char *data() const
+    {
+        return mData;
+    }
+
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    char operator[](size_t pos) const
+    {
+        return mData[pos];
+    }
+
+private:
+    void reset();
+
+    const char *mData {""};
+    size_t mSize {0};
+    void *mMapBase {nullptr};
+    size_t mMapSize {0};
+    char *mHeap {nullptr};
+};
+
+#endif
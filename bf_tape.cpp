@@ -0,0 +1,48 @@
+#include "bf_tape.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BF_TAPE_HUGE_PAGE_SIZE (2 << 20)
+
+static size_t alignUp(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+BfTape::BfTape(size_t size, bool hugePages)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t align = hugePages ? BF_TAPE_HUGE_PAGE_SIZE : page;
+    size_t tapeSize = alignUp(size, page);
+
+    // a guard page on each side, plus slack to align the tape
+    mMapSize = tapeSize + 2 * page + align - page;
+    mMapBase = mmap(nullptr, mMapSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mMapBase == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    mData = (uint8_t *)alignUp((uintptr_t)mMapBase + page, align);
+    if (mprotect(mData, tapeSize, PROT_READ | PROT_WRITE) != 0)
+    {
+        perror("mprotect");
+        exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugePages)
+    {
+        // only a hint, the kernel may not have THP enabled
+        madvise(mData, tapeSize, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+BfTape::~BfTape()
+{
+    munmap(mMapBase, mMapSize);
+}
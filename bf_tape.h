@@ -0,0 +1,35 @@
+#ifndef __bf_tape_h__
+#define __bf_tape_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BF_TAPE_DEFAULT_SIZE (1 << 20)
+#define BF_TAPE_MIN_SIZE (1 << 8)
+#define BF_TAPE_MAX_SIZE (1 << 30)
+
+// The cells of one run. Reserved with an anonymous mmap, so pages are
+// zero-filled on first touch and a program using a few cells touches a
+// few pages. Everything around the tape stays PROT_NONE as guard pages.
+// The size is a power of two and addresses wrap with size - 1.
+class BfTape
+{
+public:
+    // hugePages asks for transparent huge pages, worth it for large tapes
+    BfTape(size_t size, bool hugePages);
+    ~BfTape();
+    BfTape(const BfTape &) = delete;
+    BfTape &operator=(const BfTape &) = delete;
+
+    uint8_t *data() const
+    {
+        return mData;
+    }
+
+private:
+    void *mMapBase;
+    size_t mMapSize;
+    uint8_t *mData;
+};
+
+#endif